@@ -1,6 +1,5 @@
 // CTracker.c
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_mixer.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,13 +10,78 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/ioctl.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define MIX_HAVE_SSE2 1
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MIX_HAVE_AVX2 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MIX_HAVE_NEON 1
+#endif
+
+// MIDI input is built with -DCTRACKER_MIDI: ALSA on Linux (-lasound),
+// CoreMIDI on macOS (-framework CoreMIDI -framework CoreFoundation)
+#if defined(CTRACKER_MIDI) && defined(__linux__)
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#define MIDI_HAVE_ALSA 1
+#elif defined(CTRACKER_MIDI) && defined(__APPLE__)
+#include <CoreMIDI/CoreMIDI.h>
+#define MIDI_HAVE_COREMIDI 1
+#endif
 
 #define SAMPLE_RATE 44100
-#define MAX_ROWS 16
-#define MAX_CHANNELS 8
-#define MAX_POLYPHONY 8  // Maximum number of simultaneous notes
+#define DEFAULT_ROWS 16            // Rows in a new song
+#define DEFAULT_CHANNELS 8         // Channels in a new song
+#define MAX_CHANNELS 64            // Upper bound on channels (voices are preallocated)
+#define MAX_POLYPHONY 8            // Voices per channel, so notes can ring across rows
+#define ENGINE_BUFFER_FRAMES 2048  // Audio device buffer size in frames
+#define VOICE_BLOCK 256            // Frames rendered per voice pass
+#define MIN_BPM 20                 // Tempo range of a song
+#define MAX_BPM 300
+#define TONE_VOLUME 0.3            // Amplitude of generated tones
+#define MAX_SAMPLES 256            // Distinct samples in the bank
+#define EXPORT_BLOCK_FRAMES 65536  // Max frames per streamed export block
+#define EXPORT_BLOCK_ROWS 64       // Max rows per streamed export block
+#define EXPORT_LOOPS 4             // Loop repeats in an export unless set
+#define RENDER_CACHE_MB 256        // Rendered rows kept between exports
+#define RENDER_CACHE_BUCKETS 4096  // Hash buckets of the render cache (power of two)
+#define ARENA_ALIGN 64             // Alignment of arena allocations (a cache line)
+#define WAVE_TABLE_BITS 11         // log2 of the oscillator table length
+#define WAVE_TABLE_SIZE (1 << WAVE_TABLE_BITS)
+#define WAVE_OCTAVES 11            // Band-limited tables, one per MIDI octave
+#define SINC_TAPS 16               // Windowed-sinc taps at 1x, more when reading faster
+#define SINC_MAX_TAPS 64
+#define SINC_PHASE_BITS 8          // log2 of the kernel phases per input sample
+#define SINC_PHASES (1 << SINC_PHASE_BITS)
+#define SINC_TABLES 7              // Kernels with lower cutoffs for reading faster than 1x
+#define FX_DELAY_FRAMES 32768      // Delay line per channel (power of two, ~740 ms)
+#define FX_DELAY_MAX_MS 700        // Longest delay time a channel can set
+#define REVERB_COMBS 4             // Parallel comb filters per reverb side
+#define REVERB_ALLPASSES 2         // Series all-pass filters per reverb side
+#define REVERB_MAX_LEN 1400        // Longest comb or all-pass line in frames
+#define TTY_CHROME_LINES 11        // Screen lines around the pattern grid
+#define ENGINE_QUEUE_SIZE 256      // Commands in flight to the audio thread (power of two)
+#define STATS_BUCKETS 128          // Callback time histogram, 8 buckets per octave of us
+#define STATS_CSV_ENV "CTRACKER_STATS_CSV" // File that playback stats are appended to
+#define MIDI_SOURCE_ENV "CTRACKER_MIDI_IN" // MIDI port to connect to at startup
+#define MIDI_EVENTS_MAX 64         // MIDI events placed in one audio callback
+#define MIDI_TICKS_PER_ROW 6       // MIDI clock is 24 per beat, rows are sixteenths
+#define MIDI_CLOCK_BANDWIDTH 0.5   // Hz: how fast the clock estimate follows the master
 
 // Note names
 const char* NOTE_NAMES[] = {
@@ -38,52 +102,288 @@ const char* NOTE_NAMES[] = {
 #define TOTAL_NOTES 128
 const char* REST_NAME = "---";
 
+// Decoded sample shared by every cell that uses the same file
+typedef struct {
+    char path[64];      // WAV file this entry was loaded from
+    Sint16* data;       // Mono PCM at SAMPLE_RATE (NULL if loading failed)
+    Uint32 len;         // Length in frames
+    int refcount;       // Number of cells referencing this entry
+    int stale;          // Reload from disk on next acquire
+    int mapped;         // Data points into a song file mapping (not owned)
+    void* wav_map;      // WAV file mapping the data is read from in place (owned)
+    size_t wav_map_size;
+    Uint64 hash;        // Of the PCM, so the render cache knows it after a reload
+} Sample;
+
+// Volume envelope: linear attack and decay, exponential release.
+// Times are in frames; the release falls to -60 dB and then stops.
+typedef struct {
+    Uint32 attack;
+    Uint32 decay;
+    float sustain;      // Level held until key-off (0..1)
+    Uint32 release;
+} Envelope;
+
+// Sound source shared by every cell that names it
+typedef struct {
+    char* name;         // WAV file or built-in waveform name ("" = sine)
+    int wave;           // Built-in waveform, or -1 for a WAV sample
+    Sample* smp;        // Decoded sample from the bank (NULL if none)
+    Envelope env;       // Volume envelope of every note it plays
+    int unused;         // No cell plays it, so its sample has been let go
+} Instrument;
+
+// Hot per-cell data read by the sequencer: 8 bytes, so a row of 8
+// channels is a single cache line
 typedef struct {
-    int note;           // MIDI note (0 = rest)
-    int original_note;  // Original note of the sample
-    int duration_ms;    // duration
-    char sample[64];    // WAV file
-    int playing;        // Playback flag
-    double pitch_ratio; // Pitch shift ratio for sample
+    Uint8 note;         // MIDI note (0 = rest)
+    Uint8 original_note; // Original note of the sample
+    Uint16 instrument;  // Index into Song.instruments
+    float pitch_ratio;  // Pitch shift ratio for sample
 } Cell;
 
+// Rows of cells; the order list can play the same pattern many times
 typedef struct {
-    Cell cells[MAX_ROWS];
-} Track;
+    int num_rows;
+    Cell* cells;        // num_rows * Song.num_channels, row-major
+} Pattern;
+
+// Insert effects of one channel, in processing order. Volume and pan
+// are applied as its voices are mixed; the filter, delay and reverb
+// send run on the channel's own block, and only if one is switched on.
+typedef struct {
+    float volume;       // Linear gain (1 = unchanged)
+    float pan;          // -1 = left .. 1 = right
+    float cutoff;       // One-pole low-pass cutoff in Hz (0 = off)
+    float delay_ms;     // Delay time (0 = off), up to FX_DELAY_MAX_MS
+    float feedback;     // Part of the delayed signal fed back (0..0.95)
+    float delay_mix;    // Level of the delayed signal in the output
+    float send;         // Level sent to the shared reverb (0 = off)
+} ChannelFx;
 
 typedef struct {
-    Track channels[MAX_CHANNELS];
     int num_channels;
-    int num_rows;
+    Pattern* patterns;
+    int num_patterns;
+    int* order;         // Pattern played at each song position
+    int num_orders;
+    Instrument* instruments; // Interned by name; 0 is the plain sine tone
+    int num_instruments;
     int bpm;           // Added BPM
-    int loop_start;    // Loop start row
+    int loop_start;    // Loop start row (counted over the whole order list)
     int loop_end;      // Loop end row
     int loop_enabled;  // Loop enabled flag
+    void* file_map;    // Binary song file the pattern cells may point into
+    size_t file_map_size;
+    ChannelFx fx[MAX_CHANNELS]; // Effects of every channel, set up by channel_fx_default()
 } Song;
 
+// Copy of a song owned by the audio thread. The UI edits its own Song
+// and publishes a fresh copy after each change, so the sequencer never
+// sees a half-made edit or memory that is being reallocated.
 typedef struct {
-    double freq;
-    int duration_ms;
-    int active;
-    pthread_t thread;
-} ToneThreadData;
+    Song song;                  // Cells, order and instruments (names are not copied)
+    Sample* samples;            // Bank entries as they were when copied, per instrument
+} EngineSong;
+
+// A row of the song timeline
+typedef struct {
+    int order;          // Order list entry (-1 = pattern played directly)
+    int pattern;        // Pattern being played
+    int row;            // Row within the pattern
+} SongPos;
+
+typedef enum {
+    VOICE_TONE,
+    VOICE_SAMPLE
+} VoiceType;
+
+// Built-in oscillator waveforms, chosen by name in a cell's sample field
+typedef enum {
+    WAVE_SINE,
+    WAVE_SQUARE,
+    WAVE_SAW,
+    NUM_WAVES
+} Waveform;
+
+const char* WAVE_NAMES[NUM_WAVES] = {"sine", "square", "saw"};
+
+typedef enum {
+    ENV_ATTACK,
+    ENV_DECAY,
+    ENV_SUSTAIN,
+    ENV_RELEASE
+} EnvelopeStage;
 
 typedef struct {
-    char filename[64];
-    int note;
-    int target_note;
-    int channel;
-    int duration_ms;
-    double pitch_ratio;
     int active;
-    pthread_t thread;
-} SampleThreadData;
+    VoiceType type;
+    const float* wave;  // Oscillator table (WAVE_TABLE_SIZE + 1 entries)
+    Uint32 phase;       // Oscillator phase, full turn = 2^32
+    Uint32 inc;         // Phase increment per output frame
+    const Sint16* data; // Sample PCM, read in place
+    Uint32 len;         // Sample length in frames
+    Uint64 pos;         // Read position in frames, 32.32 fixed point
+    Uint64 step;        // Position increment per output frame (pitch ratio)
+    const float* sinc;  // Polyphase kernel for sample voices, NULL = linear
+    int sinc_taps;      // Taps per kernel row
+    Uint32 gate;        // Frames until key-off (UINT32_MAX = until note off)
+    int legato;         // Stop dead at key-off: the next note carries on
+    Envelope env;       // Copied from the instrument
+    EnvelopeStage stage;
+    float level;        // Envelope gain
+    float slope;        // Per-frame level change in attack and decay
+    float release_mul;  // Per-frame level factor in release
+    Uint32 stage_left;  // Frames left in attack, decay or release
+    Uint32 serial;      // Trigger order, for stealing the oldest voice
+    int note;           // Cell note, so a MIDI note off finds its voice
+} Voice;
+
+// Exact row timing: frames per row is SAMPLE_RATE * 15 / bpm, with the
+// fractional part carried from row to row so rows never drift
+typedef struct {
+    Uint32 frames;      // Whole frames per row
+    Uint32 remainder;   // Fractional frames per row, in 1/bpm units
+    Uint32 bpm;         // Denominator of the fraction
+    Uint32 acc;         // Accumulated fraction
+} RowClock;
+
+// Requests from the UI and MIDI threads to the audio thread
+typedef enum {
+    CMD_SONG,           // Switch to a newly published song copy
+    CMD_PLAY,           // Sequence from 'pos' (song row 'row')
+    CMD_PREVIEW,        // Play the single row at 'pos'
+    CMD_STOP,           // Stop sequencing and silence every voice
+    CMD_TEMPO,          // Change the BPM of the playing song
+    CMD_NOTE_ON,        // Play 'cell' on 'channel' for 'frames' (0 = until note off)
+    CMD_NOTE_OFF,       // Silence 'channel', or only its voices of 'cell.note' if set
+    CMD_SYNC,           // Follow MIDI clock from song row 'row'
+    CMD_CLOCK,          // MIDI clock reached a row: trigger it, held for 'frames'
+    CMD_RETIRE          // Stop reading 'ptr', then hand it back to be released
+} EngineCommandType;
+
+// How the UI thread releases memory handed back by the audio thread
+typedef enum {
+    RELEASE_SONG,       // engine_song_free()
+    RELEASE_FREE,       // free()
+    RELEASE_UNMAP       // munmap() of 'size' bytes
+} ReleaseType;
+
+typedef struct {
+    EngineCommandType type;
+    EngineSong* song;   // CMD_SONG
+    SongPos pos;        // CMD_PLAY, CMD_PREVIEW
+    int row;            // CMD_PLAY song row; CMD_TEMPO BPM
+    int channel;        // CMD_NOTE_ON, CMD_NOTE_OFF
+    Cell cell;          // CMD_NOTE_ON
+    Uint32 frames;      // CMD_NOTE_ON gate; CMD_CLOCK row length
+    Uint64 time;        // From MIDI: performance counter when it is due (0 = at once)
+    void* ptr;          // CMD_RETIRE memory
+    size_t size;        // CMD_RETIRE length in bytes
+    ReleaseType release; // CMD_RETIRE
+} EngineCommand;
+
+// Wait-free single-producer/single-consumer ring; head and tail only
+// ever grow and are on their own cache lines
+typedef struct {
+    EngineCommand items[ENGINE_QUEUE_SIZE];
+    unsigned head __attribute__((aligned(64))); // Next slot written (producer)
+    unsigned tail __attribute__((aligned(64))); // Next slot read (consumer)
+} CommandQueue;
+
+// Playback counters. The audio thread is the only writer and uses
+// atomic stores, so the UI can read them at any time.
+typedef struct {
+    Uint64 callbacks;
+    Uint64 xruns;               // Callbacks that overran the budget or started late
+    Uint64 time_total;          // Sum of callback times (us)
+    Uint32 time_min;            // Fastest callback (us)
+    Uint32 time_max;            // Slowest callback (us)
+    Uint32 budget;              // Audio length of one buffer (us)
+    Uint32 hist[STATS_BUCKETS]; // Callbacks by time, see stats_bucket()
+    int voices;                 // Voices sounding after the last callback
+    int voices_peak;
+    int queue_peak;             // Most commands waiting at the start of a callback
+} EngineStats;
 
-// Global data for tones and samples
-ToneThreadData tone_threads[MAX_CHANNELS];
-SampleThreadData sample_threads[MAX_CHANNELS];
-pthread_mutex_t audio_mutex = PTHREAD_MUTEX_INITIALIZER;
-int global_playing = 0; // Flag for stopping playback
+// Running state of a channel's effects; preallocated, so the chain
+// never allocates while it plays
+typedef struct {
+    float lp;                   // Low-pass filter output
+    Uint32 delay_pos;           // Next write in the delay line
+    int used;                   // The delay line has been written since it was cleared
+    float delay[FX_DELAY_FRAMES];
+} FxState;
+
+// Shared reverb fed by the channel sends: parallel damped combs into
+// series all-passes, with the right side's lines slightly longer
+typedef struct {
+    float comb[2][REVERB_COMBS][REVERB_MAX_LEN];
+    float comb_lp[2][REVERB_COMBS];
+    Uint32 comb_pos[2][REVERB_COMBS];
+    float allpass[2][REVERB_ALLPASSES][REVERB_MAX_LEN];
+    Uint32 allpass_pos[2][REVERB_ALLPASSES];
+} Reverb;
+
+typedef struct {
+    SDL_AudioDeviceID device;   // 0 if no device is open
+    SDL_AudioSpec spec;
+    Voice voices[MAX_CHANNELS][MAX_POLYPHONY]; // Preallocated pool per channel
+
+    // The callback takes no locks: all state arrives through 'commands',
+    // and memory it is done with goes back through 'garbage'
+    CommandQueue commands;      // UI thread -> audio thread
+    CommandQueue garbage;       // Audio thread -> UI thread (CMD_RETIRE only)
+    CommandQueue midi;          // MIDI input thread -> audio thread, timed
+    EngineSong* live;           // Copy the sequencer reads (audio thread)
+
+    // Sequencer, advanced in sample frames by the audio callback
+    Song* song;                 // &live->song while sequencing (NULL = stopped)
+    RowClock clock;
+    SongPos next_pos;           // Row triggered when row_left reaches 0
+    int next_row;               // Song row of next_pos (-1 = song is over)
+    Uint32 row_left;            // Frames until the next row starts
+    int single_row;             // Stop after one row (row preview)
+    int next_is_loop;           // next_row wraps back to the loop start
+    int synced;                 // Rows start on CMD_CLOCK instead of the row clock
+    Uint32 tone_phase[MAX_CHANNELS]; // Oscillator phase carried across rows
+    Voice* held[MAX_CHANNELS];  // Voice triggered by the sequencer on each channel
+    Uint32 held_serial[MAX_CHANNELS]; // Its serial, in case it was stolen since
+    Uint32 serial;              // Voices triggered so far
+    FxState fx[MAX_CHANNELS];   // Effect state of each channel
+    Reverb reverb;
+    
+    // Read by the UI, written atomically by the audio thread
+    int current_row;            // Song row currently sounding (-1 = none)
+    int loop_count;             // Completed loop passes
+    int finished;               // Sequencer reached the end of the song
+
+    // Instrumentation, reset when playback starts
+    EngineStats stats;
+    Uint64 last_start;          // Performance counter at the last callback start
+    Uint64 midi_base;           // Start of the previous callback: MIDI events are timed from it
+    Uint64 ticks_per_second;    // SDL performance counter frequency
+} AudioEngine;
+
+// Terminal frame: composed in memory, then only the characters that
+// differ from what the terminal shows are written, in one flush
+typedef struct {
+    int cols, rows;     // Frame size in characters
+    char* frame;        // Frame being composed, rows * cols
+    char* shown;        // What the terminal currently shows
+    int valid;          // 0 = terminal was written to directly, redraw all
+    int x, y;           // Composition position
+    int used;           // Lines composed in this frame
+    char* out;          // Escape sequences and text of one flush
+    size_t out_len, out_cap;
+} Screen;
+
+// Global audio engine, opened once for the whole session
+AudioEngine engine = {.current_row = -1};
+Sample sample_bank[MAX_SAMPLES];
+Uint64 sample_bank_hits;    // Acquires served by an entry already decoded
+Uint64 sample_bank_misses;  // Acquires that had to decode the file
+Screen screen;          // Editor display
 
 // ---- WAV file header structure ----
 #pragma pack(push, 1)
@@ -102,526 +402,2831 @@ typedef struct {
     char     data[4];        // "data"
     uint32_t data_size;      // Data size
 } WavHeader;
+
+// ---- Chunk after the data of a segment render: where its frames go ----
+typedef struct {
+    char     id[4];          // "ctsg"
+    uint32_t size;           // Chunk size - 8
+    uint32_t first_frame;    // Frame of the whole render the segment starts at
+    uint32_t frames;         // Frames in the segment
+    uint32_t total_frames;   // Frames in the whole render
+} WavSegment;
+#pragma pack(pop)
+
+// ---- Binary song file (.ctb) ----
+// Every section is 8-byte aligned and cells are stored in the in-memory
+// Cell layout, so a mapped file is used in place without parsing.
+#define SONG_FILE_MAGIC "CTRKSONG"
+#define SONG_FILE_VERSION 3         // 2 added packed samples, 3 channel effects
+#define SONG_FILE_BYTE_ORDER 0x01020304
+
+#pragma pack(push, 1)
+typedef struct {
+    char     magic[8];           // SONG_FILE_MAGIC
+    uint32_t version;            // SONG_FILE_VERSION
+    uint32_t byte_order;         // SONG_FILE_BYTE_ORDER as seen by the writer
+    uint32_t header_size;        // sizeof(SongFileHeader)
+    uint32_t cell_size;          // sizeof(Cell)
+    uint32_t num_channels;
+    uint32_t bpm;
+    int32_t  loop_enabled;
+    int32_t  loop_start;
+    int32_t  loop_end;
+    uint32_t num_patterns;
+    uint32_t num_orders;
+    uint32_t num_instruments;
+    uint64_t order_offset;       // num_orders uint32_t pattern indices
+    uint64_t patterns_offset;    // num_patterns SongFilePattern
+    uint64_t instruments_offset; // num_instruments uint32_t name offsets
+    uint64_t strings_offset;     // NUL-terminated instrument names
+    uint64_t strings_size;
+    uint64_t file_size;
+    uint64_t samples_offset;     // num_samples SongFileSample (version 2)
+    uint32_t num_samples;        // Packed samples, 0 if none
+    uint32_t reserved;
+    uint64_t effects_offset;     // num_effects SongFileEffect (version 3)
+    uint32_t num_effects;        // Channels with effects other than the defaults
+    uint32_t reserved2;
+} SongFileHeader;
+
+typedef struct {
+    uint32_t num_rows;
+    uint32_t reserved;
+    uint64_t cells_offset;       // num_rows * num_channels cells, row-major
+} SongFilePattern;
+
+// Decoded PCM of an instrument's WAV file: mono Sint16 at SAMPLE_RATE
+typedef struct {
+    uint32_t instrument;
+    uint32_t len;                // Length in frames
+    uint64_t data_offset;
+} SongFileSample;
+
+// Effects of one channel, as in ChannelFx
+typedef struct {
+    uint32_t channel;
+    float    volume;
+    float    pan;
+    float    cutoff;
+    float    delay_ms;
+    float    feedback;
+    float    delay_mix;
+    float    send;
+} SongFileEffect;
 #pragma pack(pop)
 
-// ---- Function to calculate note duration based on BPM ----
-int get_note_duration_ms(Song* song) {
-    // Duration of one row in milliseconds
-    // Formula: (60000 / BPM) / 4 (assumes 4 rows per beat)
-    if (song->bpm == 0) return 500; // Protection from division by zero
-    return (60000 / song->bpm) / 4;
+// How sample voices read between source samples
+typedef enum {
+    INTERP_LINEAR,      // Two taps: cheap, for previews and playback
+    INTERP_SINC         // Windowed sinc from a precomputed polyphase table
+} Interpolation;
+
+// Offline export settings
+typedef struct {
+    int threads;        // Export worker threads (0 = one per CPU)
+    int dither;         // TPDF dither before the 16-bit conversion
+    int interp;         // Interpolation of sample voices
+    int loops;          // Times a looped song plays its loop (0 = EXPORT_LOOPS)
+    int stems;          // Also write a WAV per channel, and one of the reverb
+    int segment_start;  // First timeline row to write
+    int segment_end;    // Timeline row to stop before (0 = the end)
+} RenderOptions;
+
+RenderOptions render_options = {0}; // Settings used by export_to_wav()
+
+// Oscillator tables, filled by oscillator_init()
+float wave_tables[NUM_WAVES][WAVE_OCTAVES][WAVE_TABLE_SIZE + 1];
+Uint32 note_phase_inc[TOTAL_NOTES];     // Phase increment per MIDI note
+
+// Windowed-sinc kernels, filled by resampler_init(). Table t is for
+// reading up to SINC_RATIOS[t] times faster than the source rate, with
+// its cutoff lowered and its width grown to match. Each has
+// SINC_PHASES + 1 rows, so a row and the next one can be blended for
+// any fractional position.
+const double SINC_RATIOS[SINC_TABLES] = {1.0, 1.25, 1.5, 2.0, 2.5, 3.0, 4.0};
+float sinc_tables[SINC_TABLES][SINC_PHASES + 1][SINC_MAX_TAPS] __attribute__((aligned(64)));
+int sinc_taps[SINC_TABLES];     // Taps used in each table, a multiple of 4
+
+// 2^(n/12) for n = -127..127, filled by pitch_table_init()
+#define SEMITONE_SPAN (2 * TOTAL_NOTES - 1)
+double semitone_ratios[SEMITONE_SPAN];
+
+// ---- Row clock: exact samples-per-row accumulator ----
+void row_clock_init(RowClock* clock, int bpm) {
+    if (bpm <= 0) bpm = 30; // Invalid BPM falls back to 500ms rows
+    if (bpm > SAMPLE_RATE * 15) bpm = SAMPLE_RATE * 15; // Rows never shorter than a frame
+    clock->frames = (SAMPLE_RATE * 15) / bpm;
+    clock->remainder = (SAMPLE_RATE * 15) % bpm;
+    clock->bpm = bpm;
+    clock->acc = 0;
 }
 
-// ---- Function to pitch shift a sample ----
-Sint16* pitch_shift_sample(const Sint16* original, Uint32 original_len, 
-                          double pitch_ratio, Uint32* new_len) {
-    if (fabs(pitch_ratio - 1.0) < 0.001) {
-        // No pitch shift needed
-        Sint16* copy = malloc(original_len * sizeof(Sint16));
-        if (copy) {
-            memcpy(copy, original, original_len * sizeof(Sint16));
-            *new_len = original_len;
-        }
-        return copy;
+// ---- Length in frames of the next row ----
+Uint32 row_clock_next(RowClock* clock) {
+    Uint32 frames = clock->frames;
+    clock->acc += clock->remainder;
+    if (clock->acc >= clock->bpm) {
+        clock->acc -= clock->bpm;
+        frames++;
     }
+    return frames;
+}
+
+// ---- Total frames of the first 'rows' rows ----
+Uint64 row_clock_total(int bpm, Uint64 rows) {
+    if (bpm <= 0) bpm = 30;
+    if (bpm > SAMPLE_RATE * 15) bpm = SAMPLE_RATE * 15;
+    return rows * (SAMPLE_RATE * 15) / bpm;
+}
+
+// ---- Convert note name to MIDI number ----
+int note_name_to_midi(const char* note_name) {
+    // Semitone of each letter, A-G
+    static const int LETTER_SEMITONE[7] = {9, 11, 0, 2, 4, 5, 7};
+    const char* p = note_name;
     
-    if (pitch_ratio > 2.0) pitch_ratio = 2.0;  // Limit pitch shift
-    if (pitch_ratio < 0.5) pitch_ratio = 0.5;
+    // Letter, optional sharp, octave -2..9; case does not matter
+    int letter = toupper((unsigned char)*p++) - 'A';
+    if (letter < 0 || letter > 6) return 0; // Rest ("---", "") or unknown
     
-    *new_len = (Uint32)(original_len / pitch_ratio);
-    Sint16* shifted = malloc(*new_len * sizeof(Sint16));
+    int semitone = LETTER_SEMITONE[letter];
+    if (*p == '#') {
+        semitone++;
+        p++;
+    }
     
-    if (!shifted) return NULL;
+    int negative = *p == '-';
+    if (negative) p++;
+    if (!isdigit((unsigned char)*p) || p[1] != '\0') return 0;
     
-    // Simple linear interpolation for pitch shifting
-    for (Uint32 i = 0; i < *new_len; i++) {
-        double src_pos = i * pitch_ratio;
-        Uint32 idx1 = (Uint32)src_pos;
-        Uint32 idx2 = idx1 + 1;
-        
-        if (idx2 >= original_len) idx2 = original_len - 1;
-        
-        double frac = src_pos - idx1;
-        double sample = original[idx1] * (1.0 - frac) + original[idx2] * frac;
-        
-        shifted[i] = (Sint16)sample;
-    }
+    int octave = negative ? -(*p - '0') : *p - '0';
+    if (octave < -2) return 0;
     
-    return shifted;
+    // Index into NOTE_NAMES: C-2 is 0; B# and E# have no name there
+    if (semitone == 12 || (letter == 4 && semitone == 5)) return 0;
+    int note = (octave + 2) * 12 + semitone;
+    return note < TOTAL_NOTES ? note : 0;
 }
 
-// ---- Thread function for playing pitch-shifted samples ----
-void* play_sample_thread(void* arg) {
-    SampleThreadData* data = (SampleThreadData*)arg;
-    
-    if (strlen(data->filename) == 0 || !data->active) {
-        return NULL;
+// ---- Convert MIDI number to note name ----
+const char* midi_to_note_name(int midi_note) {
+    if (midi_note <= 0 || midi_note >= TOTAL_NOTES) {
+        return REST_NAME;
+    }
+    return NOTE_NAMES[midi_note];
+}
+
+// ---- Build the 2^(n/12) table (once at startup) ----
+void pitch_table_init(void) {
+    for (int i = 0; i < SEMITONE_SPAN; i++) {
+        semitone_ratios[i] = pow(2.0, (i - (TOTAL_NOTES - 1)) / 12.0);
     }
+}
+
+// ---- 2^(semitones/12) for any interval between two MIDI notes ----
+double semitone_ratio(int semitones) {
+    return semitone_ratios[semitones + TOTAL_NOTES - 1];
+}
+
+// ---- Calculate pitch shift ratio ----
+double calculate_pitch_ratio(int original_note, int target_note) {
+    if (original_note <= 0 || target_note <= 0) return 1.0;
     
-    Mix_Chunk* sound = Mix_LoadWAV(data->filename);
-    if (!sound) {
-        printf("Failed to load WAV: %s\n", Mix_GetError());
-        return NULL;
+    // Pitch ratio = 2^(semitones/12), from the precomputed table
+    return semitone_ratio(target_note - original_note);
+}
+
+// ---- Zeroth-order modified Bessel function, for the Kaiser window ----
+double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
     }
+    return sum;
+}
+
+// ---- Build the windowed-sinc kernel tables (once at startup) ----
+// Kaiser-windowed, with the cutoff lowered for faster reads so pitching
+// a sample up does not alias. Each row is normalised to unit DC gain.
+void resampler_init(void) {
+    const double beta = 7.0;
     
-    if (fabs(data->pitch_ratio - 1.0) > 0.001) {
-        // Apply pitch shift
-        Uint32 original_len = sound->alen / sizeof(Sint16);
-        Uint32 new_len;
-        
-        Sint16* shifted_data = pitch_shift_sample((Sint16*)sound->abuf, 
-                                                 original_len, 
-                                                 data->pitch_ratio, 
-                                                 &new_len);
+    for (int t = 0; t < SINC_TABLES; t++) {
+        double cutoff = 0.92 / SINC_RATIOS[t];
+        int taps = ((int)ceil(SINC_TAPS * SINC_RATIOS[t]) + 3) & ~3;
+        int half = taps / 2;
+        sinc_taps[t] = taps;
         
-        if (shifted_data) {
-            // Create a new chunk with pitch-shifted data
-            Mix_FreeChunk(sound);
-            sound = Mix_QuickLoad_RAW((Uint8*)shifted_data, new_len * sizeof(Sint16));
-            if (sound) {
-                sound->allocated = 1; // Mark as allocated so SDL_mixer will free it
+        for (int p = 0; p <= SINC_PHASES; p++) {
+            double frac = (double)p / SINC_PHASES;
+            double row[SINC_MAX_TAPS];
+            double sum = 0.0;
+            
+            // Tap k reads source sample idx - half + 1 + k
+            for (int k = 0; k < taps; k++) {
+                double x = k - (half - 1) - frac;
+                double w = fabs(x) / half;
+                double window = w < 1.0 ? bessel_i0(beta * sqrt(1.0 - w * w)) / bessel_i0(beta) : 0.0;
+                double sinc = x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+                row[k] = cutoff * sinc * window;
+                sum += row[k];
+            }
+            for (int k = 0; k < taps; k++) {
+                sinc_tables[t][p][k] = (float)(row[k] / sum);
             }
         }
     }
-    
-    if (!sound) {
-        return NULL;
-    }
-    
-    // Calculate playback speed based on pitch ratio
-    // Lower pitch = longer duration, higher pitch = shorter duration
-    int play_duration = (int)(data->duration_ms / data->pitch_ratio);
-    
-    // Play on specific channel
-    Mix_PlayChannel(data->channel, sound, 0);
-    
-    // Wait for playback to complete (approximate)
-    SDL_Delay(play_duration);
-    
-    pthread_mutex_lock(&audio_mutex);
-    data->active = 0;
-    pthread_mutex_unlock(&audio_mutex);
-    
-    return NULL;
 }
 
-// ---- Function to play a tone in a separate thread ----
-void* play_tone_thread(void* arg) {
-    ToneThreadData* data = (ToneThreadData*)arg;
-    
-    if (data->freq == 0 || !data->active) {
-        return NULL;
-    }
-    
-    Uint32 samples = data->duration_ms * SAMPLE_RATE / 1000;
-    Sint16* buffer = malloc(sizeof(Sint16) * samples);
-    if (!buffer) return NULL;
-    
-    // Generate sine wave
-    for (Uint32 i = 0; i < samples; i++) {
-        buffer[i] = (Sint16)(32767 * sin(2.0 * M_PI * data->freq * i / SAMPLE_RATE));
-    }
-    
-    SDL_AudioSpec spec;
-    SDL_zero(spec);
-    spec.freq = SAMPLE_RATE;
-    spec.format = AUDIO_S16SYS;
-    spec.channels = 1;
-    spec.samples = 4096;
-    spec.callback = NULL;
-    
-    SDL_AudioDeviceID dev = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
-    if (dev == 0) {
-        free(buffer);
-        return NULL;
-    }
-    
-    SDL_QueueAudio(dev, buffer, samples * sizeof(Sint16));
-    SDL_PauseAudioDevice(dev, 0);
-    
-    // Wait for playback to complete
-    SDL_Delay(data->duration_ms);
+// ---- Switch a sample voice to the windowed-sinc table for its pitch ----
+void voice_use_sinc(Voice* v) {
+    if (v->type != VOICE_SAMPLE) return;
     
-    SDL_CloseAudioDevice(dev);
-    free(buffer);
-    
-    pthread_mutex_lock(&audio_mutex);
-    data->active = 0;
-    pthread_mutex_unlock(&audio_mutex);
-    
-    return NULL;
+    double ratio = v->step / 4294967296.0;
+    int t = 0;
+    while (t < SINC_TABLES - 1 && ratio > SINC_RATIOS[t]) t++;
+    v->sinc = &sinc_tables[t][0][0];
+    v->sinc_taps = sinc_taps[t];
 }
 
-// ---- Convert note name to MIDI number ----
-int note_name_to_midi(const char* note_name) {
-    if (strcmp(note_name, "---") == 0 || strcmp(note_name, "") == 0) {
-        return 0; // Rest
+// ---- Built-in waveform for a name; -1 if it is not one ----
+int waveform_by_name(const char* name) {
+    for (int w = 0; w < NUM_WAVES; w++) {
+        if (strcmp(name, WAVE_NAMES[w]) == 0) return w;
     }
+    return -1;
+}
+
+// ---- Build the oscillator tables (once at startup, after pitch_table_init) ----
+void oscillator_init(void) {
+    float sine[WAVE_TABLE_SIZE];
     
-    for (int i = 0; i < TOTAL_NOTES; i++) {
-        if (strcmp(note_name, NOTE_NAMES[i]) == 0) {
-            return i;
-        }
+    for (int i = 0; i < WAVE_TABLE_SIZE; i++) {
+        sine[i] = (float)sin(2.0 * M_PI * i / WAVE_TABLE_SIZE);
     }
     
-    // Try case-insensitive comparison
-    for (int i = 0; i < TOTAL_NOTES; i++) {
-        char upper_note[16];
-        char upper_input[16];
-        
-        strcpy(upper_note, NOTE_NAMES[i]);
-        strcpy(upper_input, note_name);
+    for (int oct = 0; oct < WAVE_OCTAVES; oct++) {
+        // Keep every harmonic of the octave's highest note below Nyquist
+        double top = 440.0 * semitone_ratio(oct * 12 + 11 - 69);
+        int harmonics = (int)(SAMPLE_RATE / 2 / top);
+        if (harmonics > WAVE_TABLE_SIZE / 2 - 1) harmonics = WAVE_TABLE_SIZE / 2 - 1;
+        if (harmonics < 1) harmonics = 1;
         
-        // Convert to uppercase for comparison
-        for (int j = 0; upper_note[j]; j++) upper_note[j] = toupper(upper_note[j]);
-        for (int j = 0; upper_input[j]; j++) upper_input[j] = toupper(upper_input[j]);
-        
-        if (strcmp(upper_note, upper_input) == 0) {
-            return i;
+        for (int w = 0; w < NUM_WAVES; w++) {
+            float* t = wave_tables[w][oct];
+            float peak = 0.0f;
+            
+            for (int i = 0; i < WAVE_TABLE_SIZE; i++) {
+                float v = sine[i];
+                
+                // sin(k*x) is just a stride through the sine table
+                for (int k = 2; k <= harmonics && w != WAVE_SINE; k++) {
+                    float h = sine[(k * i) & (WAVE_TABLE_SIZE - 1)] / k;
+                    if (w == WAVE_SAW) v += (k & 1) ? h : -h;
+                    else if (k & 1) v += h; // Square: odd harmonics only
+                }
+                t[i] = v;
+                if (fabsf(v) > peak) peak = fabsf(v);
+            }
+            
+            // Same peak level for every waveform and octave
+            for (int i = 0; i < WAVE_TABLE_SIZE; i++) {
+                t[i] *= (float)(32767 * TONE_VOLUME) / peak;
+            }
+            t[WAVE_TABLE_SIZE] = t[0]; // Guard entry for interpolation
         }
     }
     
-    return 0; // Default to rest if not found
+    for (int n = 0; n < TOTAL_NOTES; n++) {
+        double freq = 440.0 * semitone_ratio(n - 69);
+        note_phase_inc[n] = (Uint32)(freq / SAMPLE_RATE * 4294967296.0);
+    }
 }
 
-// ---- Convert MIDI number to note name ----
-const char* midi_to_note_name(int midi_note) {
-    if (midi_note <= 0 || midi_note >= TOTAL_NOTES) {
-        return REST_NAME;
-    }
-    return NOTE_NAMES[midi_note];
+// ---- Oscillator phase a cell advances over 'frames' (0 unless a tone) ----
+Uint32 tone_phase_advance(const Song* song, const Cell* c, Uint32 frames) {
+    if (c->note <= 0 || c->note >= TOTAL_NOTES || song->instruments[c->instrument].wave < 0) return 0;
+    return note_phase_inc[c->note] * frames;
 }
 
-// ---- Calculate pitch shift ratio ----
-double calculate_pitch_ratio(int original_note, int target_note) {
-    if (original_note <= 0 || target_note <= 0) return 1.0;
+// ---- Queue a command; returns 0 if the ring is full (never waits) ----
+int queue_push(CommandQueue* q, const EngineCommand* cmd) {
+    unsigned head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ENGINE_QUEUE_SIZE) return 0;
     
-    // Calculate semitone difference
-    int semitones = target_note - original_note;
-    
-    // Pitch ratio = 2^(semitones/12)
-    return pow(2.0, semitones / 12.0);
+    q->items[head % ENGINE_QUEUE_SIZE] = *cmd;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
 }
 
-// ---- TTY display ----
-void draw_tty(Song* song, int cursor_row, int cursor_channel) {
-    system("clear");
-    printf("CTracker (TTY) | BPM: %d", song->bpm);
+// ---- Take the oldest command; returns 0 if the ring is empty ----
+int queue_pop(CommandQueue* q, EngineCommand* cmd) {
+    unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return 0;
     
-    // Display loop status
-    if (song->loop_enabled) {
-        printf(" | LOOP: %d-%d", song->loop_start, song->loop_end);
-    } else {
-        printf(" | LOOP: OFF");
+    *cmd = q->items[tail % ENGINE_QUEUE_SIZE];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// ---- Commands waiting in a ring ----
+unsigned queue_depth(const CommandQueue* q) {
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+// ---- Free a copy made by engine_song_copy() ----
+void engine_song_free(EngineSong* copy) {
+    if (!copy) return;
+    for (int p = 0; p < copy->song.num_patterns; p++) {
+        free(copy->song.patterns[p].cells);
     }
-    printf("\n\n");
-    
-    // Channel number headers
-    printf("    ");
-    for (int ch = 0; ch < song->num_channels; ch++) {
-        printf("Ch%02d ", ch);
+    free(copy->song.patterns);
+    free(copy->song.order);
+    free(copy->song.instruments);
+    free(copy->samples);
+    free(copy);
+}
+
+// ---- Release memory the audio thread no longer reads (UI thread) ----
+void engine_release_now(const EngineCommand* cmd) {
+    switch (cmd->release) {
+        case RELEASE_SONG: engine_song_free(cmd->ptr); break;
+        case RELEASE_FREE: free(cmd->ptr); break;
+        case RELEASE_UNMAP: munmap(cmd->ptr, cmd->size); break;
     }
-    printf("\n");
+}
+
+// ---- Release everything the audio thread has handed back ----
+void engine_collect(void) {
+    EngineCommand cmd;
+    while (queue_pop(&engine.garbage, &cmd)) engine_release_now(&cmd);
+}
+
+// ---- Send a command to the audio thread; 0 if there is none ----
+// Only the UI thread waits here, for the callback to drain a full ring.
+int engine_send(const EngineCommand* cmd) {
+    for (int tries = 0; engine.device != 0 && tries < 1000; tries++) {
+        if (queue_push(&engine.commands, cmd)) return 1;
+        engine_collect();
+        SDL_Delay(1);
+    }
+    return 0;
+}
+
+// ---- Release memory once the audio thread has stopped reading it ----
+void engine_release(void* ptr, size_t size, ReleaseType release) {
+    if (!ptr) return;
     
-    // Separator line
-    printf("   +");
-    for (int ch = 0; ch < song->num_channels; ch++) {
-        printf("-----");
+    EngineCommand cmd = {.type = CMD_RETIRE, .ptr = ptr, .size = size, .release = release};
+    engine_collect();
+    if (!engine_send(&cmd)) {
+        // With no device there is no reader
+        if (engine.device == 0) engine_release_now(&cmd);
+        else printf("Warning: audio thread is not responding, leaking %zu bytes\n", size);
     }
-    printf("\n");
+}
+
+// ---- Find the format and data chunks of a RIFF/WAVE file in memory ----
+// Fills the format fields of 'header' from the "fmt " chunk, with the
+// subformat of WAVE_FORMAT_EXTENSIBLE files as 'audio_format'.
+// Returns the data chunk, or NULL if the file is not a usable WAV.
+const Uint8* wav_parse(const Uint8* file, size_t size, WavHeader* header, size_t* data_size) {
+    if (size < 12 || memcmp(file, "RIFF", 4) != 0 || memcmp(file + 8, "WAVE", 4) != 0) return NULL;
     
-    // Pattern rows
-    for (int r = 0; r < song->num_rows; r++) {
-        // Mark loop range
-        if (song->loop_enabled && r == song->loop_start) printf("[");
-        else if (song->loop_enabled && r == song->loop_end) printf("]");
-        else printf(" ");
+    int have_format = 0;
+    size_t pos = 12;
+    while (pos + 8 <= size) {
+        const Uint8* chunk = file + pos;
+        Uint32 chunk_size;
+        memcpy(&chunk_size, chunk + 4, 4);
+        size_t avail = size - pos - 8;
         
-        printf("%02d |", r);
-        for (int ch = 0; ch < song->num_channels; ch++) {
-            if (r == cursor_row && ch == cursor_channel) printf(">");
-            else printf(" ");
-            
-            Cell* c = &song->channels[ch].cells[r];
-            if (c->note > 0) {
-                const char* note_name = midi_to_note_name(c->note);
-                printf("%-4s", note_name);
-            } else {
-                printf("%-4s", REST_NAME);
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && avail >= 16) {
+            // The PCM format body is laid out exactly like the header fields
+            memcpy(&header->audio_format, chunk + 8, 16);
+            if (header->audio_format == 0xFFFE && chunk_size >= 40 && avail >= 40) {
+                memcpy(&header->audio_format, chunk + 8 + 24, 2);
             }
+            have_format = 1;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_format) return NULL;
+            // Streamed files may leave the size unset; the data runs to the end
+            *data_size = chunk_size < avail ? chunk_size : avail;
+            return chunk + 8;
         }
-        printf("\n");
+        pos += 8 + (size_t)chunk_size + (chunk_size & 1);
     }
+    return NULL;
 }
 
-// ---- Edit cell ----
-void edit_cell(Song* song, int row, int channel) {
-    char input[64];
-    char sample[64];
-    int original_note = 60; // Default C4 for new samples
+// ---- One sample of a WAV frame, on the 16-bit scale ----
+float wav_read_sample(const Uint8* p, int format, int bits) {
+    if (format == 3) {
+        if (bits == 64) {
+            double d;
+            memcpy(&d, p, 8);
+            return (float)(d * 32768.0);
+        }
+        float f;
+        memcpy(&f, p, 4);
+        return f * 32768.0f;
+    }
     
-    printf("Current note: ");
-    if (song->channels[channel].cells[row].note > 0) {
-        printf("%s", midi_to_note_name(song->channels[channel].cells[row].note));
-    } else {
-        printf("--- (rest)");
+    switch (bits) {
+        case 8:  return (p[0] - 128) * 256.0f;
+        case 16: return (Sint16)(p[0] | p[1] << 8);
+        case 24: return (Sint32)((Uint32)p[0] << 8 | (Uint32)p[1] << 16 | (Uint32)p[2] << 24) / 65536.0f;
+        default: return (Sint32)((Uint32)p[0] | (Uint32)p[1] << 8 | (Uint32)p[2] << 16 | (Uint32)p[3] << 24) / 65536.0f;
     }
-    printf("\n");
+}
+
+// ---- Round and clip to 16-bit ----
+Sint16 wav_clip(float x) {
+    if (x >= 32767.0f) return 32767;
+    if (x <= -32768.0f) return -32768;
+    return (Sint16)lrintf(x);
+}
+
+// ---- Load a WAV file as mono 16-bit PCM at SAMPLE_RATE ----
+// The file is mapped, not read. Mono 16-bit files at SAMPLE_RATE are
+// used in place: *map is then set to the mapping, which the caller
+// owns and unmaps along with the data. Anything else is decoded into
+// a malloc'ed buffer, averaging the channels and resampling linearly.
+// 8/16/24/32-bit integer and 32/64-bit float PCM are supported.
+Sint16* load_wav_mono(const char* filename, Uint32* len, void** map, size_t* map_size) {
+    *map = NULL;
+    *map_size = 0;
     
-    // Check if there's already a sample
-    if (strlen(song->channels[channel].cells[row].sample) > 0) {
-        printf("Current sample: %s (base note: %s)\n", 
-               song->channels[channel].cells[row].sample,
-               midi_to_note_name(song->channels[channel].cells[row].original_note));
-        original_note = song->channels[channel].cells[row].original_note;
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < 12) {
+        printf("Failed to load WAV: Could not open %s\n", filename);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    Uint8* file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        printf("Failed to load WAV: Could not map %s\n", filename);
+        return NULL;
     }
     
-    printf("Enter note (e.g., C4, A#3, F-1) or '---' for rest: ");
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0; // remove \n
+    WavHeader fmt;
+    size_t data_size = 0;
+    const Uint8* data = wav_parse(file, size, &fmt, &data_size);
+    int format = data ? fmt.audio_format : 0;
+    int bits = data ? fmt.bits_per_sample : 0;
+    int channels = data ? fmt.num_channels : 0;
+    int width = bits / 8;
+    int pcm_ok = format == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32);
+    int float_ok = format == 3 && (bits == 32 || bits == 64);
     
-    printf("Enter WAV file (leave empty if none): ");
-    fgets(sample, sizeof(sample), stdin);
-    sample[strcspn(sample, "\n")] = 0; // remove \n
+    if (!data || !(pcm_ok || float_ok) || channels < 1 || fmt.sample_rate == 0 ||
+        fmt.block_align < channels * width) {
+        printf("Unsupported WAV format: %s\n", filename);
+        munmap(file, size);
+        return NULL;
+    }
     
-    int note = note_name_to_midi(input);
+    size_t frames = data_size / fmt.block_align;
+    if (frames > UINT32_MAX / 2) frames = UINT32_MAX / 2;
     
-    // If a new sample is provided, ask for its original note
-    if (strlen(sample) > 0 && note > 0) {
-        char orig_note_input[64];
-        printf("What is the original note of this sample? (e.g., C4): ");
-        fgets(orig_note_input, sizeof(orig_note_input), stdin);
-        orig_note_input[strcspn(orig_note_input, "\n")] = 0;
-        
-        original_note = note_name_to_midi(orig_note_input);
-        if (original_note <= 0) original_note = 60; // Default to C4
-    } else if (strlen(sample) == 0 && strlen(song->channels[channel].cells[row].sample) > 0) {
-        // Keep original note if sample stays the same
-        original_note = song->channels[channel].cells[row].original_note;
+    // Already in the engine's format: read it where it lies
+    if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && format == 1 && bits == 16 && channels == 1 && fmt.sample_rate == SAMPLE_RATE &&
+        ((uintptr_t)data & 1) == 0) {
+        *map = file;
+        *map_size = size;
+        *len = (Uint32)frames;
+        return (Sint16*)data;
     }
     
-    song->channels[channel].cells[row].note = note;
-    song->channels[channel].cells[row].original_note = original_note;
-    song->channels[channel].cells[row].duration_ms = get_note_duration_ms(song);
-    strcpy(song->channels[channel].cells[row].sample, sample);
+    // Mix the channels down, then convert the rate
+    float* mono = malloc((frames ? frames : 1) * sizeof(float));
+    if (!mono) {
+        munmap(file, size);
+        return NULL;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        const Uint8* frame = data + i * fmt.block_align;
+        float sum = 0.0f;
+        for (int c = 0; c < channels; c++) sum += wav_read_sample(frame + c * width, format, bits);
+        mono[i] = sum / channels;
+    }
+    munmap(file, size);
     
-    // Calculate pitch ratio
-    if (note > 0 && original_note > 0) {
-        song->channels[channel].cells[row].pitch_ratio = 
-            calculate_pitch_ratio(original_note, note);
-    } else {
-        song->channels[channel].cells[row].pitch_ratio = 1.0;
+    double step = (double)fmt.sample_rate / SAMPLE_RATE;
+    size_t out_frames = (size_t)((Uint64)frames * SAMPLE_RATE / fmt.sample_rate);
+    if (out_frames > UINT32_MAX / 2) out_frames = UINT32_MAX / 2;
+    Sint16* out = malloc((out_frames ? out_frames : 1) * sizeof(Sint16));
+    if (!out) {
+        free(mono);
+        return NULL;
     }
     
-    printf("Set to: ");
-    if (note > 0) {
-        printf("%s", midi_to_note_name(note));
-        if (strlen(sample) > 0) {
-            printf(" (sample: %s, original: %s, pitch: %.3fx)", 
-                   sample, 
-                   midi_to_note_name(original_note),
-                   song->channels[channel].cells[row].pitch_ratio);
-        }
-    } else {
-        printf("--- (rest)");
+    for (size_t i = 0; i < out_frames; i++) {
+        double pos = i * step;
+        size_t i0 = (size_t)pos;
+        size_t i1 = i0 + 1 < frames ? i0 + 1 : i0;
+        float frac = (float)(pos - i0);
+        out[i] = wav_clip(mono[i0] + (mono[i1] - mono[i0]) * frac);
     }
-    printf("\n");
+    free(mono);
+    
+    *len = (Uint32)out_frames;
+    return out;
 }
 
-// ---- Non-blocking input check (simplified version) ----
-int kbhit() {
-    struct timeval tv = {0L, 0L};
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(0, &fds);
-    return select(1, &fds, NULL, NULL, &tv);
+// ---- 64-bit FNV-1a hash of sample PCM ----
+Uint64 sample_hash(const Sint16* data, Uint32 len) {
+    Uint64 h = 14695981039346656037ULL;
+    
+    for (Uint32 i = 0; data && i < len; i++) {
+        h = (h ^ (Uint16)data[i]) * 1099511628211ULL;
+    }
+    return h ^ len;
 }
 
-// ---- Play row with 8 sounds simultaneously ----
-void play_row(Song* song, int row) {
-    int note_duration = get_note_duration_ms(song);
-    
-    printf("Row %02d: ", row);
-    
-    // Stop all previous playback
-    for (int i = 0; i < MAX_CHANNELS; i++) {
-        pthread_mutex_lock(&audio_mutex);
-        if (tone_threads[i].active) {
-            tone_threads[i].active = 0;
-        }
-        if (sample_threads[i].active) {
-            sample_threads[i].active = 0;
-        }
-        pthread_mutex_unlock(&audio_mutex);
+// ---- Hand an entry's PCM back once the audio thread is done with it ----
+void sample_free_data(Sample* entry) {
+    if (entry->wav_map) {
+        engine_release(entry->wav_map, entry->wav_map_size, RELEASE_UNMAP);
+    } else if (!entry->mapped) {
+        engine_release(entry->data, entry->len * sizeof(Sint16), RELEASE_FREE);
     }
+    entry->data = NULL;
+    entry->len = 0;
+    entry->mapped = 0;
+    entry->wav_map = NULL;
+    entry->wav_map_size = 0;
+}
+
+// ---- Get a sample from the bank, decoding it on first use ----
+Sample* sample_bank_acquire(const char* path) {
+    if (strlen(path) == 0 || waveform_by_name(path) >= 0) return NULL;
+    if (strlen(path) >= sizeof(sample_bank[0].path)) {
+        printf("Sample path too long: %s\n", path);
+        return NULL;
+    }
+
+    Sample* entry = NULL;
+    Sample* free_slot = NULL;
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        if (sample_bank[i].refcount > 0 && strcmp(sample_bank[i].path, path) == 0) {
+            entry = &sample_bank[i];
+            break;
+        }
+        if (!free_slot && sample_bank[i].refcount == 0) free_slot = &sample_bank[i];
+    }
+
+    if (entry && !entry->stale) {
+        entry->refcount++;
+        sample_bank_hits++;
+        return entry;
+    }
+
+    sample_bank_misses++;
+    if (!entry) {
+        if (!free_slot) {
+            printf("Sample bank full, cannot load %s\n", path);
+            return NULL;
+        }
+        entry = free_slot;
+        strcpy(entry->path, path);
+        entry->data = NULL;
+        entry->len = 0;
+    }
+
+    // Failed loads stay in the bank with no data, so a missing file is
+    // reported once instead of on every trigger
+    Uint32 len = 0;
+    void* map;
+    size_t map_size;
+    Sint16* data = load_wav_mono(path, &len, &map, &map_size);
+
+    sample_free_data(entry);
+    entry->data = data;
+    entry->len = data ? len : 0;
+    entry->wav_map = map;
+    entry->wav_map_size = map_size;
+    entry->hash = sample_hash(entry->data, entry->len);
+
+    entry->stale = 0;
+    entry->refcount++;
+    return entry;
+}
+
+// ---- Drop a reference; the PCM is freed with the last one ----
+void sample_bank_release(Sample* entry) {
+    if (!entry || entry->refcount <= 0) return;
+
+    if (--entry->refcount == 0) {
+        sample_free_data(entry);
+        entry->path[0] = '\0';
+        entry->stale = 0;
+    }
+}
+
+// ---- Add a reference to PCM packed in a song file, used in place ----
+// A sample that is already decoded is shared instead. One marked stale
+// is left for sample_bank_acquire() to decode again, and NULL returned,
+// as when the bank is full.
+Sample* sample_bank_adopt(const char* path, Sint16* data, Uint32 len) {
+    if (strlen(path) >= sizeof(sample_bank[0].path)) return NULL;
+    
+    Sample* free_slot = NULL;
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        if (sample_bank[i].refcount > 0 && strcmp(sample_bank[i].path, path) == 0) {
+            // Never a second entry for the path, wherever the free slot is
+            if (sample_bank[i].stale) return NULL;
+            sample_bank[i].refcount++;
+            sample_bank_hits++;
+            return &sample_bank[i];
+        }
+        if (!free_slot && sample_bank[i].refcount == 0) free_slot = &sample_bank[i];
+    }
+    
+    if (!free_slot) return NULL;
+    
+    strcpy(free_slot->path, path);
+    free_slot->data = data;
+    free_slot->len = len;
+    free_slot->mapped = 1;
+    free_slot->wav_map = NULL;
+    free_slot->wav_map_size = 0;
+    free_slot->hash = sample_hash(data, len);
+    free_slot->stale = 0;
+    free_slot->refcount = 1;
+    sample_bank_hits++; // Packed in the song file, so never decoded
+    return free_slot;
+}
+
+// ---- Copy samples out of a mapping that is about to be unmapped ----
+void sample_bank_detach(const void* map, size_t size) {
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        Sample* entry = &sample_bank[i];
+        if (!entry->mapped || (const char*)entry->data < (const char*)map ||
+            (const char*)entry->data >= (const char*)map + size) {
+            continue;
+        }
+        
+        // Still referenced by another song: it keeps a private copy
+        Sint16* copy = malloc(entry->len * sizeof(Sint16));
+        if (copy) memcpy(copy, entry->data, entry->len * sizeof(Sint16));
+        
+        entry->data = copy;
+        entry->len = copy ? entry->len : 0;
+        entry->mapped = 0;
+    }
+}
+
+// ---- Force a sample to be decoded again on its next acquire ----
+void sample_bank_invalidate(const char* path) {
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        if (sample_bank[i].refcount > 0 && strcmp(sample_bank[i].path, path) == 0) {
+            sample_bank[i].stale = 1;
+        }
+    }
+}
+
+// ---- Cells of one pattern row (row-major, num_channels wide) ----
+Cell* pattern_row(const Song* song, int pattern, int row) {
+    return &song->patterns[pattern].cells[(size_t)row * song->num_channels];
+}
+
+// ---- Cell at a pattern row and channel ----
+Cell* song_cell(const Song* song, int pattern, int row, int channel) {
+    return &pattern_row(song, pattern, row)[channel];
+}
+
+// ---- Total rows played by the order list ----
+int song_length(const Song* song) {
+    int rows = 0;
+    for (int i = 0; i < song->num_orders; i++) {
+        rows += song->patterns[song->order[i]].num_rows;
+    }
+    return rows;
+}
+
+// ---- Timeline position of a song row; returns 0 past the end ----
+int song_pos_at(const Song* song, int song_row, SongPos* pos) {
+    for (int i = 0; i < song->num_orders && song_row >= 0; i++) {
+        int rows = song->patterns[song->order[i]].num_rows;
+        if (song_row < rows) {
+            pos->order = i;
+            pos->pattern = song->order[i];
+            pos->row = song_row;
+            return 1;
+        }
+        song_row -= rows;
+    }
+    return 0;
+}
+
+// ---- Step to the next timeline row; returns 0 past the end ----
+int song_pos_next(const Song* song, SongPos* pos) {
+    if (++pos->row < song->patterns[pos->pattern].num_rows) return 1;
+    if (pos->order < 0 || ++pos->order >= song->num_orders) return 0;
+    
+    pos->pattern = song->order[pos->order];
+    pos->row = 0;
+    return 1;
+}
+
+// ---- First song row of a pattern in the order list (-1 if unused) ----
+int song_pattern_offset(const Song* song, int pattern) {
+    int rows = 0;
+    for (int i = 0; i < song->num_orders; i++) {
+        if (song->order[i] == pattern) return rows;
+        rows += song->patterns[song->order[i]].num_rows;
+    }
+    return -1;
+}
+
+// ---- Keep the loop inside the song after its length changes ----
+void song_clamp_loop(Song* song) {
+    int length = song_length(song);
+    if (song->loop_end >= length) song->loop_end = length - 1;
+    if (song->loop_start >= song->loop_end) song->loop_enabled = 0;
+}
+
+// ---- Default envelope for an instrument ----
+// Tones get a short attack so they start without a click; samples keep
+// their own attack and ring out for longer after key-off.
+Envelope envelope_default(int wave) {
+    Envelope env = {0, 0, 1.0f, SAMPLE_RATE / 4};
+    if (wave >= 0) {
+        env.attack = SAMPLE_RATE / 500;   // 2 ms
+        env.release = SAMPLE_RATE / 20;   // 50 ms
+    }
+    return env;
+}
+
+// ---- Index of the instrument for a name, adding it if new; -1 on error ----
+// An unused instrument of that name takes its sample back; a new name
+// takes the place of an unused one before the table grows.
+int song_instrument(Song* song, const char* name) {
+    int spare = -1;
+    for (int i = 0; i < song->num_instruments; i++) {
+        Instrument* ins = &song->instruments[i];
+        if (strcmp(ins->name, name) == 0) {
+            if (ins->unused) {
+                ins->smp = ins->wave < 0 ? sample_bank_acquire(name) : NULL;
+                ins->unused = 0;
+            }
+            return i;
+        }
+        if (spare < 0 && ins->unused) spare = i;
+    }
+    
+    char* copy = strdup(name);
+    if (!copy) return -1;
+    
+    if (spare < 0) {
+        Instrument* grown = song->num_instruments <= UINT16_MAX ?
+            realloc(song->instruments, (song->num_instruments + 1) * sizeof(Instrument)) : NULL;
+        if (!grown) {
+            free(copy);
+            return -1;
+        }
+        song->instruments = grown;
+        spare = song->num_instruments++;
+    } else {
+        free(song->instruments[spare].name);
+    }
+    
+    Instrument* ins = &song->instruments[spare];
+    ins->name = copy;
+    ins->wave = strlen(name) == 0 ? WAVE_SINE : waveform_by_name(name);
+    ins->smp = ins->wave < 0 ? sample_bank_acquire(name) : NULL;
+    ins->env = envelope_default(ins->wave);
+    ins->unused = 0;
+    return spare;
+}
+
+// ---- Let go of the samples of instruments no cell plays any more ----
+// They stay in the table, so the indices in cells keep their meaning,
+// and are taken up again by song_instrument(). Instrument 0 is the
+// default of empty cells and always stays.
+void song_sweep_instruments(Song* song) {
+    Uint8* used = calloc(song->num_instruments, 1);
+    if (!used) return;
+    
+    for (int p = 0; p < song->num_patterns; p++) {
+        size_t count = (size_t)song->patterns[p].num_rows * song->num_channels;
+        for (size_t i = 0; i < count; i++) used[song->patterns[p].cells[i].instrument] = 1;
+    }
+    for (int i = 1; i < song->num_instruments; i++) {
+        Instrument* ins = &song->instruments[i];
+        if (used[i] || ins->unused) continue;
+        sample_bank_release(ins->smp);
+        ins->smp = NULL;
+        ins->unused = 1;
+    }
+    free(used);
+}
+
+// ---- Decode an instrument's WAV file again ----
+void instrument_reload(Instrument* ins) {
+    if (ins->wave >= 0) return;
+    
+    Sample* old_smp = ins->smp;
+    sample_bank_invalidate(ins->name);
+    ins->smp = sample_bank_acquire(ins->name);
+    sample_bank_release(old_smp);
+}
+
+// ---- Empty cells for 'count' slots ----
+Cell* cells_alloc(size_t count) {
+    Cell* cells = calloc(count > 0 ? count : 1, sizeof(Cell));
+    if (!cells) return NULL;
+    
+    for (size_t i = 0; i < count; i++) {
+        cells[i].original_note = 60; // Default C4
+        cells[i].pitch_ratio = 1.0f;
+    }
+    return cells;
+}
+
+// ---- Append an empty pattern; returns its index or -1 ----
+int song_add_pattern(Song* song, int num_rows) {
+    Cell* cells = cells_alloc((size_t)num_rows * song->num_channels);
+    Pattern* grown = cells ? realloc(song->patterns, (song->num_patterns + 1) * sizeof(Pattern)) : NULL;
+    if (!grown) {
+        free(cells);
+        return -1;
+    }
+    
+    song->patterns = grown;
+    song->patterns[song->num_patterns].num_rows = num_rows;
+    song->patterns[song->num_patterns].cells = cells;
+    return song->num_patterns++;
+}
+
+// ---- Replace the order list; every entry must name a pattern ----
+int song_set_order(Song* song, const int* order, int num_orders) {
+    if (num_orders <= 0) return 0;
+    for (int i = 0; i < num_orders; i++) {
+        if (order[i] < 0 || order[i] >= song->num_patterns) return 0;
+    }
+    
+    int* copy = malloc(num_orders * sizeof(int));
+    if (!copy) return 0;
+    memcpy(copy, order, num_orders * sizeof(int));
+    
+    free(song->order);
+    song->order = copy;
+    song->num_orders = num_orders;
+    song_clamp_loop(song);
+    return 1;
+}
+
+// ---- Free pattern cells unless they live in the song's file mapping ----
+void pattern_cells_free(Song* song, Cell* cells) {
+    const char* map = song->file_map;
+    if (map && (const char*)cells >= map && (const char*)cells < map + song->file_map_size) return;
+    free(cells);
+}
+
+// ---- Release everything a song owns ----
+void song_free(Song* song) {
+    for (int i = 0; i < song->num_instruments; i++) {
+        sample_bank_release(song->instruments[i].smp);
+        free(song->instruments[i].name);
+    }
+    for (int i = 0; i < song->num_patterns; i++) {
+        pattern_cells_free(song, song->patterns[i].cells);
+    }
+    if (song->file_map) {
+        sample_bank_detach(song->file_map, song->file_map_size);
+        engine_release(song->file_map, song->file_map_size, RELEASE_UNMAP);
+    }
+    free(song->instruments);
+    free(song->patterns);
+    free(song->order);
+    song->instruments = NULL;
+    song->num_instruments = 0;
+    song->patterns = NULL;
+    song->num_patterns = 0;
+    song->order = NULL;
+    song->num_orders = 0;
+    song->file_map = NULL;
+    song->file_map_size = 0;
+}
+
+// ---- Effects of a channel in a new song: none, panned by the channel layout ----
+// Channels 0-3 are left and 4-7 right; wider songs repeat the layout
+// in groups of 8 channels.
+ChannelFx channel_fx_default(int channel) {
+    ChannelFx fx = {0};
+    fx.volume = 1.0f;
+    fx.pan = channel % 8 < 4 ? -1.0f : 1.0f;
+    return fx;
+}
+
+// ---- Reset every channel's effects ----
+void song_fx_reset(Song* song) {
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        song->fx[ch] = channel_fx_default(ch);
+    }
+}
+
+// ---- Set up a song with one empty pattern; returns 0 if out of memory ----
+int song_init(Song* song, int num_channels, int num_rows) {
+    memset(song, 0, sizeof(*song));
+    song->num_channels = num_channels;
+    song->bpm = 120;  // Default BPM value
+    song->loop_end = num_rows - 1;
+    song_fx_reset(song);
+    
+    int first = 0;
+    if (song_instrument(song, "") != 0 || song_add_pattern(song, num_rows) != 0 ||
+        !song_set_order(song, &first, 1)) {
+        song_free(song);
+        return 0;
+    }
+    return 1;
+}
+
+// ---- Resize a pattern, and every pattern's channel count ----
+// Overlapping cells are kept.
+int song_resize(Song* song, int pattern, int num_channels, int num_rows) {
+    int count = song->num_patterns;
+    Cell* cells[count];
+    
+    for (int p = 0; p < count; p++) {
+        int rows = p == pattern ? num_rows : song->patterns[p].num_rows;
+        cells[p] = cells_alloc((size_t)rows * num_channels);
+        if (!cells[p]) {
+            while (p-- > 0) free(cells[p]);
+            return 0;
+        }
+    }
+    
+    for (int p = 0; p < count; p++) {
+        Pattern* pat = &song->patterns[p];
+        int rows = p == pattern ? num_rows : pat->num_rows;
+        
+        for (int r = 0; r < rows && r < pat->num_rows; r++) {
+            for (int ch = 0; ch < num_channels && ch < song->num_channels; ch++) {
+                cells[p][(size_t)r * num_channels + ch] = *song_cell(song, p, r, ch);
+            }
+        }
+        pattern_cells_free(song, pat->cells);
+        pat->cells = cells[p];
+        pat->num_rows = rows;
+    }
+    
+    song->num_channels = num_channels;
+    song_clamp_loop(song);
+    return 1;
+}
+
+// ---- Output gains for a channel's volume and pan ----
+// Balance law: the far side fades out as a channel is panned, and a
+// channel panned fully to one side plays at 0.7 there.
+void channel_gains(const ChannelFx* fx, float* gain_l, float* gain_r) {
+    float pan = fx->pan < -1.0f ? -1.0f : fx->pan > 1.0f ? 1.0f : fx->pan;
+
+    *gain_l = 0.7f * fx->volume * (pan > 0.0f ? 1.0f - pan : 1.0f);
+    *gain_r = 0.7f * fx->volume * (pan < 0.0f ? 1.0f + pan : 1.0f);
+}
+
+// ---- Whether a channel runs its block through the effect chain ----
+// Volume and pan cost nothing extra, so they leave a channel on the
+// direct path.
+int channel_fx_active(const ChannelFx* fx) {
+    return fx->cutoff > 0.0f || fx->delay_ms > 0.0f || fx->send > 0.0f;
+}
+
+// ---- Set up a voice for a cell; returns 0 if there is nothing to play ----
+// The note is held for 'frames' and then released by its envelope.
+int voice_start(Voice* v, const Cell* c, const Instrument* ins, Uint32 frames) {
+    memset(v, 0, sizeof(*v));
+    v->gate = frames;
+    v->env = ins->env;
+    v->note = c->note;
+
+    int wave = ins->wave;
+    if (wave < 0) {
+        if (!ins->smp || !ins->smp->data || frames == 0) return 0;
+
+        // Pitch is applied while reading, so any ratio works
+        double ratio = c->pitch_ratio > 0.0f ? c->pitch_ratio : 1.0;
+        v->type = VOICE_SAMPLE;
+        v->data = ins->smp->data;
+        v->len = ins->smp->len;
+        v->step = (Uint64)(ratio * 4294967296.0);
+    } else {
+        if (c->note <= 0 || c->note >= TOTAL_NOTES) return 0;
+
+        // Phase starts at 0; callers carry it on from the previous row
+        v->type = VOICE_TONE;
+        v->wave = wave_tables[wave][c->note / 12];
+        v->inc = note_phase_inc[c->note];
+    }
+
+    const Envelope* env = &v->env;
+    if (env->attack > 0) {
+        v->stage = ENV_ATTACK;
+        v->slope = 1.0f / env->attack;
+        v->stage_left = env->attack;
+    } else if (env->decay > 0) {
+        v->stage = ENV_DECAY;
+        v->level = 1.0f;
+        v->slope = (env->sustain - 1.0f) / env->decay;
+        v->stage_left = env->decay;
+    } else {
+        v->stage = ENV_SUSTAIN;
+        v->level = env->sustain;
+    }
+    v->release_mul = env->release > 0 ? expf(logf(0.001f) / env->release) : 0.0f;
+
+    v->active = frames > 0;
+    return v->active;
+}
+
+// ---- Enter a voice straight at its sustain level (legato from the last note) ----
+void voice_legato(Voice* v) {
+    v->stage = ENV_SUSTAIN;
+    v->level = v->env.sustain;
+}
+
+// ---- Is a tone voice at key-off, with its release not yet started? ----
+// A tone on the next row then takes over instead, without a gap.
+int voice_at_key_off(const Voice* v) {
+    return v->active && v->type == VOICE_TONE && v->gate == 0 && v->stage != ENV_RELEASE;
+}
+
+// ---- Apply the envelope to a rendered block; returns frames still sounding ----
+Uint32 envelope_apply(Voice* v, float* out, Uint32 frames) {
+    Uint32 i = 0;
+
+    while (i < frames) {
+        if (v->gate == 0 && v->stage != ENV_RELEASE) {
+            // Key-off: release from wherever the envelope is
+            if (v->legato || v->env.release == 0) {
+                v->active = 0;
+                return i;
+            }
+            v->stage = ENV_RELEASE;
+            v->stage_left = v->env.release;
+        }
+
+        // Run up to the next stage change or key-off
+        Uint32 n = frames - i;
+        if (v->stage != ENV_SUSTAIN && n > v->stage_left) n = v->stage_left;
+        if (v->stage != ENV_RELEASE && n > v->gate) n = v->gate;
+
+        float level = v->level;
+        float* o = out + i;
+        if (v->stage == ENV_RELEASE) {
+            for (Uint32 k = 0; k < n; k++) {
+                o[k] *= level;
+                level *= v->release_mul;
+            }
+        } else if (v->stage == ENV_SUSTAIN) {
+            for (Uint32 k = 0; k < n; k++) o[k] *= level;
+        } else {
+            for (Uint32 k = 0; k < n; k++) {
+                o[k] *= level;
+                level += v->slope;
+            }
+        }
+        v->level = level;
+        i += n;
+        if (v->stage != ENV_RELEASE && v->gate != UINT32_MAX) v->gate -= n;
+
+        if (v->stage == ENV_SUSTAIN || (v->stage_left -= n) > 0) continue;
+
+        if (v->stage == ENV_RELEASE) {
+            v->active = 0;
+            return i;
+        }
+        if (v->stage == ENV_ATTACK && v->env.decay > 0) {
+            v->stage = ENV_DECAY;
+            v->level = 1.0f;
+            v->slope = (v->env.sustain - 1.0f) / v->env.decay;
+            v->stage_left = v->env.decay;
+        } else {
+            voice_legato(v);
+        }
+    }
+    return frames;
+}
+
+// ---- Read a sample voice through its windowed-sinc table ----
+// Blends the two kernel rows either side of the position and takes a
+// dot product in four lanes, which vectorises. Taps past either end of
+// the sample read silence.
+Uint32 voice_render_sinc(Voice* v, float* out, Uint32 frames) {
+    const Sint16* src = v->data;
+    const Sint32 len = (Sint32)v->len;
+    const int taps = v->sinc_taps;
+    const int half = taps / 2;
+    Uint32 i = 0;
+    
+    for (; i < frames; i++) {
+        Sint32 idx = (Sint32)(v->pos >> 32);
+        if (idx >= len) {
+            v->active = 0;
+            break;
+        }
+        
+        Uint32 frac = (Uint32)v->pos;
+        const float* k0 = v->sinc + (frac >> (32 - SINC_PHASE_BITS)) * SINC_MAX_TAPS;
+        const float* k1 = k0 + SINC_MAX_TAPS;
+        float blend = (frac << SINC_PHASE_BITS) * (1.0f / 4294967296.0f);
+        
+        float in[SINC_MAX_TAPS];
+        Sint32 first = idx - half + 1;
+        if (first >= 0 && first + taps <= len) {
+            for (int k = 0; k < taps; k++) in[k] = src[first + k];
+        } else {
+            for (int k = 0; k < taps; k++) {
+                Sint32 j = first + k;
+                in[k] = j >= 0 && j < len ? src[j] : 0.0f;
+            }
+        }
+        
+        // Four independent lanes, summed in a fixed order at the end
+        float lanes[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (int k = 0; k < taps; k += 4) {
+            for (int j = 0; j < 4; j++) {
+                lanes[j] += in[k + j] * (k0[k + j] + (k1[k + j] - k0[k + j]) * blend);
+            }
+        }
+        out[i] = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+        v->pos += v->step;
+    }
+    return i;
+}
+
+// ---- Render up to 'frames' mono samples from a voice ----
+Uint32 voice_render(Voice* v, float* out, Uint32 frames) {
+    if (!v->active) return 0;
+
+    if (v->type == VOICE_TONE) {
+        // Table lookup with linear interpolation; phase wraps by itself
+        const float* t = v->wave;
+        for (Uint32 i = 0; i < frames; i++) {
+            Uint32 idx = v->phase >> (32 - WAVE_TABLE_BITS);
+            float frac = (v->phase << WAVE_TABLE_BITS) * (1.0f / 4294967296.0f);
+
+            out[i] = t[idx] + (t[idx + 1] - t[idx]) * frac;
+            v->phase += v->inc;
+        }
+    } else if (v->sinc) {
+        frames = voice_render_sinc(v, out, frames);
+    } else {
+        // Linear interpolation straight from the shared PCM
+        const Sint16* src = v->data;
+        Uint32 len = v->len;
+        Uint32 i = 0;
+
+        for (; i < frames; i++) {
+            Uint32 idx = (Uint32)(v->pos >> 32);
+            if (idx >= len) {
+                v->active = 0;
+                break;
+            }
+            float frac = (Uint32)v->pos * (1.0f / 4294967296.0f);
+            float s0 = src[idx];
+            float s1 = idx + 1 < len ? src[idx + 1] : s0;
+
+            out[i] = s0 + (s1 - s0) * frac;
+            v->pos += v->step;
+        }
+        frames = i;
+    }
+
+    return envelope_apply(v, out, frames);
+}
+
+// ---- Mix kernels ----
+// mix_pan adds a mono voice block into the interleaved stereo float bus,
+// quantize is the single output stage: add optional dither, clip, and
+// round to 16-bit. Every variant uses the same operation order and
+// round-to-nearest, so they all produce identical samples.
+typedef struct {
+    const char* name;
+    void (*mix_pan)(float* bus, const float* in, Uint32 frames, float gain_l, float gain_r);
+    void (*quantize)(Sint16* out, const float* bus, const float* noise, Uint32 samples);
+} MixKernels;
+
+// ---- Scalar mix of a mono block into the stereo bus ----
+void mix_pan_scalar(float* bus, const float* in, Uint32 frames, float gain_l, float gain_r) {
+    for (Uint32 i = 0; i < frames; i++) {
+        bus[i*2] += in[i] * gain_l;
+        bus[i*2+1] += in[i] * gain_r;
+    }
+}
+
+// ---- Scalar output stage; 'noise' may be NULL ----
+void quantize_scalar(Sint16* out, const float* bus, const float* noise, Uint32 samples) {
+    for (Uint32 i = 0; i < samples; i++) {
+        float s = noise ? bus[i] + noise[i] : bus[i];
+        if (s > 32767.0f) s = 32767.0f;
+        if (s < -32768.0f) s = -32768.0f;
+        out[i] = (Sint16)lrintf(s);
+    }
+}
+
+#ifdef MIX_HAVE_SSE2
+// ---- SSE2: 4 frames per step ----
+void mix_pan_sse2(float* bus, const float* in, Uint32 frames, float gain_l, float gain_r) {
+    __m128 gains = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+    Uint32 i = 0;
+
+    for (; i + 4 <= frames; i += 4) {
+        // Duplicate each sample into an L/R pair, then scale the pairs
+        __m128 s = _mm_loadu_ps(in + i);
+        float* dst = bus + i*2;
+
+        _mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(dst), _mm_mul_ps(_mm_unpacklo_ps(s, s), gains)));
+        _mm_storeu_ps(dst + 4, _mm_add_ps(_mm_loadu_ps(dst + 4), _mm_mul_ps(_mm_unpackhi_ps(s, s), gains)));
+    }
+    mix_pan_scalar(bus + i*2, in + i, frames - i, gain_l, gain_r);
+}
+
+void quantize_sse2(Sint16* out, const float* bus, const float* noise, Uint32 samples) {
+    __m128 hi = _mm_set1_ps(32767.0f);
+    __m128 lo = _mm_set1_ps(-32768.0f);
+    Uint32 i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128 a = _mm_loadu_ps(bus + i);
+        __m128 b = _mm_loadu_ps(bus + i + 4);
+        if (noise) {
+            a = _mm_add_ps(a, _mm_loadu_ps(noise + i));
+            b = _mm_add_ps(b, _mm_loadu_ps(noise + i + 4));
+        }
+        __m128i ia = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(a, hi), lo));
+        __m128i ib = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(b, hi), lo));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(ia, ib));
+    }
+    quantize_scalar(out + i, bus + i, noise ? noise + i : NULL, samples - i);
+}
+#endif
+
+#ifdef MIX_HAVE_AVX2
+// ---- AVX2: 8 frames per step, picked at runtime ----
+__attribute__((target("avx2")))
+void mix_pan_avx2(float* bus, const float* in, Uint32 frames, float gain_l, float gain_r) {
+    __m256 gains = _mm256_setr_ps(gain_l, gain_r, gain_l, gain_r, gain_l, gain_r, gain_l, gain_r);
+    Uint32 i = 0;
+
+    for (; i + 8 <= frames; i += 8) {
+        // Pairs for frames 0-3 and 4-7, built from the 128-bit halves
+        __m128 s0 = _mm_loadu_ps(in + i);
+        __m128 s1 = _mm_loadu_ps(in + i + 4);
+        __m256 p0 = _mm256_set_m128(_mm_unpackhi_ps(s0, s0), _mm_unpacklo_ps(s0, s0));
+        __m256 p1 = _mm256_set_m128(_mm_unpackhi_ps(s1, s1), _mm_unpacklo_ps(s1, s1));
+        float* dst = bus + i*2;
+
+        _mm256_storeu_ps(dst, _mm256_add_ps(_mm256_loadu_ps(dst), _mm256_mul_ps(p0, gains)));
+        _mm256_storeu_ps(dst + 8, _mm256_add_ps(_mm256_loadu_ps(dst + 8), _mm256_mul_ps(p1, gains)));
+    }
+    // The scalar tail is SSE code; clear the upper halves before it runs
+    _mm256_zeroupper();
+    mix_pan_scalar(bus + i*2, in + i, frames - i, gain_l, gain_r);
+}
+
+__attribute__((target("avx2")))
+void quantize_avx2(Sint16* out, const float* bus, const float* noise, Uint32 samples) {
+    __m256 hi = _mm256_set1_ps(32767.0f);
+    __m256 lo = _mm256_set1_ps(-32768.0f);
+    Uint32 i = 0;
+
+    for (; i + 16 <= samples; i += 16) {
+        __m256 a = _mm256_loadu_ps(bus + i);
+        __m256 b = _mm256_loadu_ps(bus + i + 8);
+        if (noise) {
+            a = _mm256_add_ps(a, _mm256_loadu_ps(noise + i));
+            b = _mm256_add_ps(b, _mm256_loadu_ps(noise + i + 8));
+        }
+        __m256i ia = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(a, hi), lo));
+        __m256i ib = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(b, hi), lo));
+        // Packs work per 128-bit lane, so restore the 64-bit quarters' order
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(ia, ib), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i), p);
+    }
+    _mm256_zeroupper();
+    quantize_scalar(out + i, bus + i, noise ? noise + i : NULL, samples - i);
+}
+#endif
+
+#ifdef MIX_HAVE_NEON
+// ---- NEON: 4 frames per step ----
+void mix_pan_neon(float* bus, const float* in, Uint32 frames, float gain_l, float gain_r) {
+    Uint32 i = 0;
+
+    for (; i + 4 <= frames; i += 4) {
+        float32x4_t s = vld1q_f32(in + i);
+        float32x4x2_t pair = vld2q_f32(bus + i*2);
+
+        pair.val[0] = vaddq_f32(pair.val[0], vmulq_n_f32(s, gain_l));
+        pair.val[1] = vaddq_f32(pair.val[1], vmulq_n_f32(s, gain_r));
+        vst2q_f32(bus + i*2, pair);
+    }
+    mix_pan_scalar(bus + i*2, in + i, frames - i, gain_l, gain_r);
+}
+
+void quantize_neon(Sint16* out, const float* bus, const float* noise, Uint32 samples) {
+    float32x4_t hi = vdupq_n_f32(32767.0f);
+    float32x4_t lo = vdupq_n_f32(-32768.0f);
+    Uint32 i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        float32x4_t a = vld1q_f32(bus + i);
+        float32x4_t b = vld1q_f32(bus + i + 4);
+        if (noise) {
+            a = vaddq_f32(a, vld1q_f32(noise + i));
+            b = vaddq_f32(b, vld1q_f32(noise + i + 4));
+        }
+        int32x4_t ia = vcvtnq_s32_f32(vmaxq_f32(vminq_f32(a, hi), lo));
+        int32x4_t ib = vcvtnq_s32_f32(vmaxq_f32(vminq_f32(b, hi), lo));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(ia), vqmovn_s32(ib)));
+    }
+    quantize_scalar(out + i, bus + i, noise ? noise + i : NULL, samples - i);
+}
+#endif
+
+// Every variant built into this binary, slowest first
+const MixKernels MIX_KERNEL_TABLE[] = {
+    {"scalar", mix_pan_scalar, quantize_scalar},
+#ifdef MIX_HAVE_SSE2
+    {"sse2", mix_pan_sse2, quantize_sse2},
+#endif
+#ifdef MIX_HAVE_AVX2
+    {"avx2", mix_pan_avx2, quantize_avx2},
+#endif
+#ifdef MIX_HAVE_NEON
+    {"neon", mix_pan_neon, quantize_neon},
+#endif
+};
+#define NUM_MIX_KERNELS (int)(sizeof(MIX_KERNEL_TABLE) / sizeof(MIX_KERNEL_TABLE[0]))
+
+// Kernels used by the mixer; scalar until mix_kernels_init() runs
+MixKernels mix_kernels = {"scalar", mix_pan_scalar, quantize_scalar};
+
+// ---- Check whether this CPU can run a kernel set ----
+int mix_kernels_supported(const MixKernels* k) {
+#ifdef MIX_HAVE_AVX2
+    if (strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+#endif
+    (void)k;
+    return 1;
+}
+
+// ---- Select the fastest kernels this CPU supports ----
+void mix_kernels_init(void) {
+    for (int i = 0; i < NUM_MIX_KERNELS; i++) {
+        if (mix_kernels_supported(&MIX_KERNEL_TABLE[i])) mix_kernels = MIX_KERNEL_TABLE[i];
+    }
+}
+
+// ---- TPDF dither for interleaved samples starting at 'first' ----
+// The noise is a hash of the absolute sample index, so a given output
+// sample gets the same dither no matter how the render is split up.
+void dither_fill(float* noise, Uint64 first, Uint32 samples) {
+    for (Uint32 i = 0; i < samples; i++) {
+        Uint64 h = (first + i) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 31;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 29;
+
+        // Sum of two uniform values: triangular over +-1 LSB
+        float u0 = (Uint32)h * (1.0f / 4294967296.0f);
+        float u1 = (Uint32)(h >> 32) * (1.0f / 4294967296.0f);
+        noise[i] = u0 - u1;
+    }
+}
+
+// ---- Add one block of a channel's voices to the float stereo bus ----
+// Returns the number of voices still sounding afterwards.
+int mix_voices(Voice* voices, int count, float* bus, Uint32 frames, float gain_l, float gain_r) {
+    float block[VOICE_BLOCK];
+    int sounding = 0;
+
+    for (int i = 0; i < count; i++) {
+        Voice* v = &voices[i];
+        Uint32 rendered = voice_render(v, block, frames);
+
+        if (rendered > 0) mix_kernels.mix_pan(bus, block, rendered, gain_l, gain_r);
+        sounding += v->active;
+    }
+    return sounding;
+}
+
+// ---- Add one block of a channel's voices to a mono block, for its effects ----
+int mix_voices_mono(Voice* voices, int count, float* out, Uint32 frames) {
+    float block[VOICE_BLOCK];
+    int sounding = 0;
+
+    for (int i = 0; i < count; i++) {
+        Uint32 rendered = voice_render(&voices[i], block, frames);
+
+        for (Uint32 j = 0; j < rendered; j++) out[j] += block[j];
+        sounding += voices[i].active;
+    }
+    return sounding;
+}
+
+// ---- Clear a channel's effect state ----
+void fx_state_clear(FxState* st) {
+    st->lp = 0.0f;
+    st->delay_pos = 0;
+    if (st->used) memset(st->delay, 0, sizeof(st->delay));
+    st->used = 0;
+}
+
+// ---- Run a mono block through a channel's effects into the bus ----
+// The filtered and delayed block is panned into 'bus', and into 'stem'
+// too unless it is NULL, and its reverb send added to 'send'. At most
+// VOICE_BLOCK frames.
+void fx_channel(const ChannelFx* fx, FxState* st, float* block, float* bus, float* stem, float* send, Uint32 frames) {
+    if (fx->cutoff > 0.0f) {
+        float a = 1.0f - expf(-2.0f * (float)M_PI * fx->cutoff / SAMPLE_RATE);
+        float y = st->lp;
+        for (Uint32 i = 0; i < frames; i++) {
+            y += a * (block[i] - y);
+            block[i] = y;
+        }
+        st->lp = fabsf(y) < 1e-20f ? 0.0f : y; // No denormals once it is quiet
+    }
+
+    if (fx->delay_ms > 0.0f) {
+        float ms = fx->delay_ms < FX_DELAY_MAX_MS ? fx->delay_ms : FX_DELAY_MAX_MS;
+        Uint32 delay = (Uint32)(ms * (SAMPLE_RATE / 1000.0f));
+        float feedback = fx->feedback < 0.95f ? fx->feedback : 0.95f;
+        Uint32 pos = st->delay_pos;
+        if (delay == 0) delay = 1;
+
+        for (Uint32 i = 0; i < frames; i++) {
+            float echo = st->delay[(pos - delay) & (FX_DELAY_FRAMES - 1)];
+            st->delay[pos] = block[i] + echo * feedback;
+            block[i] += echo * fx->delay_mix;
+            pos = (pos + 1) & (FX_DELAY_FRAMES - 1);
+        }
+        st->delay_pos = pos;
+        st->used = 1;
+    }
+
+    float gain_l, gain_r;
+    channel_gains(fx, &gain_l, &gain_r);
+    mix_kernels.mix_pan(bus, block, frames, gain_l, gain_r);
+    if (stem) mix_kernels.mix_pan(stem, block, frames, gain_l, gain_r);
+    for (Uint32 i = 0; fx->send > 0.0f && i < frames; i++) send[i] += block[i] * fx->send;
+}
+
+// Comb and all-pass lengths of the left side, in frames
+const Uint32 REVERB_COMB_LEN[REVERB_COMBS] = {1116, 1188, 1277, 1356};
+const Uint32 REVERB_ALLPASS_LEN[REVERB_ALLPASSES] = {556, 441};
+#define REVERB_SPREAD 23    // Extra frames on every line of the right side
+
+// ---- Add the reverb of a block of sends to the stereo bus ----
+void reverb_process(Reverb* rv, const float* send, float* bus, Uint32 frames) {
+    const float feedback = 0.84f;
+    const float damp = 0.2f;
+    const float wet = 0.25f;
+
+    for (int side = 0; side < 2; side++) {
+        for (Uint32 i = 0; i < frames; i++) {
+            float in = send[i] * 0.015f;
+            float out = 0.0f;
+
+            for (int c = 0; c < REVERB_COMBS; c++) {
+                Uint32 len = REVERB_COMB_LEN[c] + side * REVERB_SPREAD;
+                Uint32 pos = rv->comb_pos[side][c];
+                float y = rv->comb[side][c][pos];
+                float lp = y + (rv->comb_lp[side][c] - y) * damp;
+                rv->comb_lp[side][c] = lp;
+                rv->comb[side][c][pos] = in + lp * feedback;
+                rv->comb_pos[side][c] = pos + 1 < len ? pos + 1 : 0;
+                out += y;
+            }
+
+            for (int a = 0; a < REVERB_ALLPASSES; a++) {
+                Uint32 len = REVERB_ALLPASS_LEN[a] + side * REVERB_SPREAD;
+                Uint32 pos = rv->allpass_pos[side][a];
+                float y = rv->allpass[side][a][pos];
+                rv->allpass[side][a][pos] = out + y * 0.5f;
+                rv->allpass_pos[side][a] = pos + 1 < len ? pos + 1 : 0;
+                out = y - out;
+            }
+
+            bus[i * 2 + side] += out * wet;
+        }
+    }
+}
+
+// ---- Convert a bus block to 16-bit, dithered if 'dither' is set ----
+void bus_to_s16(Sint16* out, const float* bus, Uint32 frames, int dither, Uint64 first_frame) {
+    float noise[VOICE_BLOCK * 2];
+
+    if (dither) dither_fill(noise, first_frame * 2, frames * 2);
+    mix_kernels.quantize(out, bus, dither ? noise : NULL, frames * 2);
+}
+
+// ---- Clear the playback counters (audio thread) ----
+void engine_stats_reset(AudioEngine* eng) {
+    EngineStats* st = &eng->stats;
+    
+    __atomic_store_n(&st->callbacks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->xruns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->time_total, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->time_min, UINT32_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->time_max, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->voices_peak, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->queue_peak, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        __atomic_store_n(&st->hist[i], 0, __ATOMIC_RELAXED);
+    }
+    eng->last_start = 0;
+}
+
+// ---- Histogram bucket of a callback time: exact below 8 us, then 8 per octave ----
+int stats_bucket(Uint32 us) {
+    if (us < 8) return (int)us;
+    
+    int octave = 31 - __builtin_clz(us);
+    int bucket = (octave - 2) * 8 + (int)((us >> (octave - 3)) & 7);
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// ---- Upper edge of a histogram bucket in microseconds ----
+Uint32 stats_bucket_top(int bucket) {
+    if (bucket < 8) return (Uint32)bucket + 1;
+    return (Uint32)(9 + bucket % 8) << (bucket / 8 - 1);
+}
+
+// ---- Count one callback that took 'start' to 'end' (audio thread) ----
+// SDL does not report underruns, so a callback counts as an xrun when it
+// took longer than its buffer lasts, or started so late after the last
+// one that the device must have run dry.
+void engine_stats_update(AudioEngine* eng, Uint32 frames, Uint64 start, Uint64 end, int voices) {
+    EngineStats* st = &eng->stats;
+    Uint64 tps = eng->ticks_per_second;
+    Uint32 budget = (Uint32)((Uint64)frames * 1000000 / SAMPLE_RATE);
+    Uint32 us = (Uint32)((end - start) * 1000000 / tps);
+    Uint64 gap = eng->last_start ? (start - eng->last_start) * 1000000 / tps : 0;
+    eng->last_start = start;
+    
+    if (us > budget || gap > (Uint64)budget * 3 / 2) {
+        __atomic_store_n(&st->xruns, st->xruns + 1, __ATOMIC_RELAXED);
+    }
+    
+    int bucket = stats_bucket(us);
+    __atomic_store_n(&st->hist[bucket], st->hist[bucket] + 1, __ATOMIC_RELAXED);
+    
+    __atomic_store_n(&st->budget, budget, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->time_total, st->time_total + us, __ATOMIC_RELAXED);
+    if (us < st->time_min) __atomic_store_n(&st->time_min, us, __ATOMIC_RELAXED);
+    if (us > st->time_max) __atomic_store_n(&st->time_max, us, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->voices, voices, __ATOMIC_RELAXED);
+    if (voices > st->voices_peak) __atomic_store_n(&st->voices_peak, voices, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->callbacks, st->callbacks + 1, __ATOMIC_RELAXED);
+}
+
+// ---- Voice for a new note on a channel, stealing one if all are busy ----
+// A free voice is used first, then the quietest one in its release,
+// then the oldest (audio thread).
+Voice* engine_voice_alloc(AudioEngine* eng, int channel) {
+    Voice* pool = eng->voices[channel];
+    Voice* quietest = NULL;
+    Voice* oldest = NULL;
+
+    for (int i = 0; i < MAX_POLYPHONY; i++) {
+        Voice* v = &pool[i];
+        if (!v->active) return v;
+
+        if (v->stage == ENV_RELEASE && (!quietest || v->level < quietest->level)) quietest = v;
+        if (!oldest || (Sint32)(v->serial - oldest->serial) < 0) oldest = v;
+    }
+    return quietest ? quietest : oldest;
+}
+
+// ---- Trigger the next row, held for 'frames' (audio thread) ----
+void engine_sequence_row(AudioEngine* eng, Uint32 frames) {
+    Song* song = eng->song;
+    SongPos pos = eng->next_pos;
+
+    // A row on MIDI clock lasts until the next tick, not a set length
+    for (int ch = 0; eng->synced && ch < MAX_CHANNELS; ch++) {
+        Voice* held = eng->held[ch];
+        if (held && held->serial == eng->held_serial[ch]) held->gate = 0;
+    }
+
+    if (eng->next_row < 0) {
+        // The last row has run out
+        eng->song = NULL;
+        __atomic_store_n(&eng->current_row, -1, __ATOMIC_RELAXED);
+        __atomic_store_n(&eng->finished, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (eng->next_is_loop) __atomic_store_n(&eng->loop_count, eng->loop_count + 1, __ATOMIC_RELAXED);
+
+    // Notes are held for exactly this row's length in frames, then
+    // ring out in their release while the next rows play
+    Cell* cells = pattern_row(song, pos.pattern, pos.row);
+    Uint32 gate = eng->synced ? UINT32_MAX : frames;
+    for (int ch = 0; ch < song->num_channels; ch++) {
+        Cell* c = &cells[ch];
+        Voice v;
+
+        if (c->note > 0 && voice_start(&v, c, &song->instruments[c->instrument], gate)) {
+            // Consecutive tones continue the channel's waveform seamlessly:
+            // the last one stops at key-off and this one starts at sustain
+            v.phase = eng->tone_phase[ch];
+            Voice* held = eng->held[ch];
+            Voice* slot;
+            if (held && held->serial == eng->held_serial[ch] && voice_at_key_off(held) &&
+                v.type == VOICE_TONE) {
+                voice_legato(&v);
+                // Rows on MIDI clock vary in length; take the phase the held tone reached
+                if (eng->synced) v.phase = held->phase;
+                slot = held;
+            } else {
+                slot = engine_voice_alloc(eng, ch);
+            }
+            v.serial = ++eng->serial;
+            *slot = v;
+            eng->held[ch] = slot;
+            eng->held_serial[ch] = v.serial;
+        }
+        eng->tone_phase[ch] += tone_phase_advance(song, c, frames);
+    }
+
+    __atomic_store_n(&eng->current_row, eng->single_row ? -1 : eng->next_row, __ATOMIC_RELAXED);
+    eng->row_left = eng->synced ? UINT32_MAX : frames;
+
+    // Work out the following row
+    eng->next_is_loop = 0;
+    if (eng->single_row) {
+        eng->next_row = -1;
+    } else if (song->loop_enabled && eng->next_row + 1 > song->loop_end) {
+        eng->next_row = song->loop_start;
+        song_pos_at(song, song->loop_start, &eng->next_pos);
+        eng->next_is_loop = 1;
+    } else if (song_pos_next(song, &eng->next_pos)) {
+        eng->next_row++;
+    } else {
+        eng->next_row = -1;
+    }
+}
+
+// ---- Copy a song for the audio thread; NULL if out of memory ----
+EngineSong* engine_song_copy(const Song* song) {
+    EngineSong* copy = calloc(1, sizeof(EngineSong));
+    if (!copy) return NULL;
+    
+    Song* s = &copy->song;
+    *s = *song;
+    s->file_map = NULL;
+    s->patterns = calloc(song->num_patterns, sizeof(Pattern));
+    s->order = malloc(song->num_orders * sizeof(int));
+    s->instruments = malloc(song->num_instruments * sizeof(Instrument));
+    copy->samples = calloc(song->num_instruments, sizeof(Sample));
+    int ok = s->patterns && s->order && s->instruments && copy->samples;
+    
+    for (int p = 0; ok && p < song->num_patterns; p++) {
+        size_t count = (size_t)song->patterns[p].num_rows * song->num_channels;
+        s->patterns[p].num_rows = song->patterns[p].num_rows;
+        s->patterns[p].cells = malloc(count * sizeof(Cell));
+        ok = s->patterns[p].cells != NULL;
+        if (ok) memcpy(s->patterns[p].cells, song->patterns[p].cells, count * sizeof(Cell));
+    }
+    
+    // The audio thread reads its own copy of each bank entry, so the UI
+    // can change the bank without racing it
+    for (int i = 0; ok && i < song->num_instruments; i++) {
+        s->instruments[i] = song->instruments[i];
+        s->instruments[i].name = NULL;
+        if (song->instruments[i].smp) {
+            copy->samples[i] = *song->instruments[i].smp;
+            s->instruments[i].smp = &copy->samples[i];
+        }
+    }
+    if (ok) memcpy(s->order, song->order, song->num_orders * sizeof(int));
+    
+    if (!ok) {
+        s->num_patterns = s->patterns ? song->num_patterns : 0;
+        engine_song_free(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+// ---- Hand the audio thread a copy of the song after it changed ----
+// Playback carries on from the same song row in the new copy.
+void engine_publish(const Song* song) {
+    engine_collect();
+    if (engine.device == 0) return;
+    
+    EngineCommand cmd = {.type = CMD_SONG};
+    cmd.song = engine_song_copy(song);
+    if (!cmd.song) {
+        printf("Error: Could not copy song for playback\n");
+        return;
+    }
+    if (!engine_send(&cmd)) engine_song_free(cmd.song);
+}
+
+// ---- Switch to a newly published song (audio thread) ----
+void engine_set_song(AudioEngine* eng, EngineSong* next) {
+    EngineSong* old = eng->live;
+    eng->live = next;
+    
+    if (eng->song) {
+        Song* song = &next->song;
+        eng->song = song;
+        if (eng->clock.bpm != (Uint32)song->bpm) row_clock_init(&eng->clock, song->bpm);
+        
+        // Find the next row again: patterns may have changed length
+        if (eng->single_row) {
+            if (eng->next_pos.pattern >= song->num_patterns ||
+                eng->next_pos.row >= song->patterns[eng->next_pos.pattern].num_rows) {
+                eng->next_row = -1;
+            }
+        } else if (eng->next_row >= 0 && !song_pos_at(song, eng->next_row, &eng->next_pos)) {
+            if (song->loop_enabled && song_pos_at(song, song->loop_start, &eng->next_pos)) {
+                eng->next_row = song->loop_start;
+                eng->next_is_loop = 1;
+            } else {
+                eng->next_row = -1;
+            }
+        }
+    }
+    
+    if (old) {
+        EngineCommand back = {.type = CMD_RETIRE, .ptr = old, .release = RELEASE_SONG};
+        queue_push(&eng->garbage, &back);
+    }
+}
+
+// ---- Apply one command from the UI (audio thread) ----
+void engine_apply(AudioEngine* eng, const EngineCommand* cmd) {
+    switch (cmd->type) {
+        case CMD_SONG:
+            engine_set_song(eng, cmd->song);
+            break;
+        
+        case CMD_PLAY:
+        case CMD_PREVIEW:
+        case CMD_SYNC:
+            if (!eng->live) break;
+            if (cmd->type == CMD_SYNC) {
+                // Song rows from MIDI have not been mapped to a position yet
+                SongPos pos;
+                if (!song_pos_at(&eng->live->song, cmd->row, &pos)) break;
+                eng->next_pos = pos;
+            } else {
+                eng->next_pos = cmd->pos;
+            }
+            row_clock_init(&eng->clock, eng->live->song.bpm);
+            eng->song = &eng->live->song;
+            eng->next_row = cmd->type == CMD_PREVIEW ? 0 : cmd->row;
+            eng->next_is_loop = 0;
+            eng->synced = cmd->type == CMD_SYNC;
+            eng->row_left = eng->synced ? UINT32_MAX : 0; // A synced song waits for the clock
+            eng->single_row = cmd->type == CMD_PREVIEW;
+            memset(eng->tone_phase, 0, sizeof(eng->tone_phase));
+            memset(eng->held, 0, sizeof(eng->held));
+            __atomic_store_n(&eng->current_row, -1, __ATOMIC_RELAXED);
+            __atomic_store_n(&eng->loop_count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&eng->finished, 0, __ATOMIC_RELAXED);
+            if (cmd->type != CMD_PREVIEW) engine_stats_reset(eng);
+            break;
+        
+        case CMD_CLOCK:
+            if (eng->song && eng->synced) engine_sequence_row(eng, cmd->frames);
+            break;
+        
+        case CMD_STOP:
+            eng->song = NULL;
+            eng->synced = 0;
+            __atomic_store_n(&eng->current_row, -1, __ATOMIC_RELAXED);
+            memset(eng->voices, 0, sizeof(eng->voices));
+            memset(eng->held, 0, sizeof(eng->held));
+            for (int ch = 0; ch < MAX_CHANNELS; ch++) fx_state_clear(&eng->fx[ch]);
+            memset(&eng->reverb, 0, sizeof(eng->reverb));
+            break;
+        
+        case CMD_TEMPO:
+            if (eng->live) eng->live->song.bpm = cmd->row;
+            if (eng->song && eng->clock.bpm != (Uint32)cmd->row) row_clock_init(&eng->clock, cmd->row);
+            break;
+        
+        case CMD_NOTE_ON: {
+            const Cell* c = &cmd->cell;
+            Voice v;
+            if (!eng->live || cmd->channel < 0 || cmd->channel >= eng->live->song.num_channels ||
+                c->instrument >= eng->live->song.num_instruments) {
+                break;
+            }
+            if (voice_start(&v, c, &eng->live->song.instruments[c->instrument],
+                            cmd->frames ? cmd->frames : UINT32_MAX)) {
+                v.serial = ++eng->serial;
+                *engine_voice_alloc(eng, cmd->channel) = v;
+            }
+            break;
+        }
+        
+        case CMD_NOTE_OFF:
+            // Release every note still held on the channel, or just one
+            if (cmd->channel < 0 || cmd->channel >= MAX_CHANNELS) break;
+            for (int i = 0; i < MAX_POLYPHONY; i++) {
+                Voice* v = &eng->voices[cmd->channel][i];
+                if (cmd->cell.note > 0 && v->note != cmd->cell.note) continue;
+                if (v->stage != ENV_RELEASE) v->gate = 0;
+            }
+            break;
+        
+        case CMD_RETIRE: {
+            // Stop every voice and copied bank entry that points into it
+            const char* lo = cmd->ptr;
+            const char* hi = lo + cmd->size;
+            Voice* voices = &eng->voices[0][0];
+            for (int i = 0; i < MAX_CHANNELS * MAX_POLYPHONY; i++) {
+                const char* data = (const char*)voices[i].data;
+                if (voices[i].active && data >= lo && data < hi) voices[i].active = 0;
+            }
+            for (int i = 0; eng->live && i < eng->live->song.num_instruments; i++) {
+                Sample* smp = &eng->live->samples[i];
+                if ((const char*)smp->data >= lo && (const char*)smp->data < hi) {
+                    smp->data = NULL;
+                    smp->len = 0;
+                }
+            }
+            queue_push(&eng->garbage, cmd);
+            break;
+        }
+    }
+}
+
+// ---- Mix a block of every channel, through its effects if it has any ----
+// Returns the number of voices still sounding (audio thread).
+int engine_mix(AudioEngine* eng, float* bus, Uint32 frames) {
+    const ChannelFx* song_fx = eng->live ? eng->live->song.fx : NULL;
+    float block[VOICE_BLOCK];
+    float send[VOICE_BLOCK];
+    int sends = 0;
+    int sounding = 0;
+
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        ChannelFx fx = song_fx ? song_fx[ch] : channel_fx_default(ch);
+        FxState* st = &eng->fx[ch];
+
+        if (!channel_fx_active(&fx)) {
+            // A chain that was switched off forgets its echoes
+            if (st->used) fx_state_clear(st);
+            float gain_l, gain_r;
+            channel_gains(&fx, &gain_l, &gain_r);
+            sounding += mix_voices(eng->voices[ch], MAX_POLYPHONY, bus, frames, gain_l, gain_r);
+            continue;
+        }
+
+        if (fx.send > 0.0f && !sends++) memset(send, 0, frames * sizeof(float));
+        memset(block, 0, frames * sizeof(float));
+        sounding += mix_voices_mono(eng->voices[ch], MAX_POLYPHONY, block, frames);
+        fx_channel(&fx, st, block, bus, NULL, send, frames);
+    }
+
+    if (sends > 0) reverb_process(&eng->reverb, send, bus, frames);
+    return sounding;
+}
+
+// ---- Audio callback: sequence rows and mix all voices ----
+// Never blocks: commands are taken only while their reply is sure to fit.
+void engine_callback(void* userdata, Uint8* stream, int len) {
+    AudioEngine* eng = (AudioEngine*)userdata;
+    Uint64 start = SDL_GetPerformanceCounter();
+    Sint16* out = (Sint16*)stream;
+    Uint32 frames = len / (2 * sizeof(Sint16));
+    Uint32 total = frames;
+    float bus[VOICE_BLOCK * 2];
+    int voices = 0;
+    EngineCommand cmd;
+
+    int waiting = (int)queue_depth(&eng->commands);
+    while (queue_depth(&eng->garbage) < ENGINE_QUEUE_SIZE && queue_pop(&eng->commands, &cmd)) {
+        engine_apply(eng, &cmd);
+    }
+    // After the commands, since CMD_PLAY clears the counters
+    if (waiting > eng->stats.queue_peak) __atomic_store_n(&eng->stats.queue_peak, waiting, __ATOMIC_RELAXED);
+
+    // MIDI events that arrived during the last callback land at the same
+    // offset in this one: one buffer of latency, but no jitter
+    EngineCommand events[MIDI_EVENTS_MAX];
+    Uint32 event_at[MIDI_EVENTS_MAX];
+    int num_events = 0;
+    Uint64 base = eng->midi_base ? eng->midi_base : start;
+    while (num_events < MIDI_EVENTS_MAX && queue_pop(&eng->midi, &events[num_events])) {
+        Uint64 due = events[num_events].time;
+        Uint64 at = due > base ? due - base : 0;
+        at = at < eng->ticks_per_second ? at * SAMPLE_RATE / eng->ticks_per_second : total;
+        if (at >= total) at = total - 1;
+        if (num_events > 0 && at < event_at[num_events - 1]) at = event_at[num_events - 1];
+        event_at[num_events++] = (Uint32)at;
+    }
+    eng->midi_base = start;
+
+    int next_event = 0;
+    while (frames > 0) {
+        Uint32 done = total - frames;
+        while (next_event < num_events && event_at[next_event] <= done) {
+            engine_apply(eng, &events[next_event++]);
+        }
+        if (eng->song && !eng->synced && eng->row_left == 0) {
+            engine_sequence_row(eng, row_clock_next(&eng->clock));
+        }
+
+        // Never render across a row boundary or a MIDI event, so
+        // triggers are sample-accurate
+        Uint32 n = frames < VOICE_BLOCK ? frames : VOICE_BLOCK;
+        if (eng->song && n > eng->row_left) n = eng->row_left;
+        if (next_event < num_events && n > event_at[next_event] - done) n = event_at[next_event] - done;
+        memset(bus, 0, n * 2 * sizeof(float));
+        voices = engine_mix(eng, bus, n);
+        bus_to_s16(out, bus, n, 0, 0);
+
+        if (eng->song && !eng->synced) eng->row_left -= n;
+        out += n * 2;
+        frames -= n;
+    }
+
+    engine_stats_update(eng, total, start, SDL_GetPerformanceCounter(), voices);
+}
+
+// ---- Open the audio device (once per session) ----
+int engine_open(void) {
+    SDL_AudioSpec want;
+    SDL_zero(want);
+    want.freq = SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = ENGINE_BUFFER_FRAMES;
+    want.callback = engine_callback;
+    want.userdata = &engine;
+
+    memset(engine.voices, 0, sizeof(engine.voices));
+    engine.ticks_per_second = SDL_GetPerformanceFrequency();
+    engine_stats_reset(&engine);
+
+    // No allowed changes: SDL converts to the hardware format for us
+    engine.device = SDL_OpenAudioDevice(NULL, 0, &want, &engine.spec, 0);
+    if (engine.device == 0) {
+        printf("SDL_OpenAudioDevice error: %s\n", SDL_GetError());
+        return 0;
+    }
+
+    SDL_PauseAudioDevice(engine.device, 0);
+    return 1;
+}
+
+// ---- Close the audio device ----
+void engine_close(void) {
+    if (engine.device == 0) return;
+
+    SDL_CloseAudioDevice(engine.device);
+    engine.device = 0;
+
+    memset(engine.voices, 0, sizeof(engine.voices));
+    
+    // The callback has stopped: release what it never got to
+    EngineCommand cmd;
+    while (queue_pop(&engine.commands, &cmd)) {
+        if (cmd.type == CMD_SONG) engine_song_free(cmd.song);
+        if (cmd.type == CMD_RETIRE) engine_release_now(&cmd);
+    }
+    while (queue_pop(&engine.midi, &cmd)) {}
+    engine_collect();
     
-    // Wait a bit for threads to finish
-    SDL_Delay(10);
+    engine.song = NULL;
+    engine_song_free(engine.live);
+    engine.live = NULL;
+}
+
+// ---- Play the song from a song row ----
+void engine_play(Song* song, int start_row) {
+    EngineCommand cmd = {.type = CMD_PLAY, .row = start_row};
+    if (!song_pos_at(song, start_row, &cmd.pos)) return;
     
-    // Start playback for each channel with active note
-    int active_channels = 0;
-    for (int ch = 0; ch < song->num_channels; ch++) {
-        Cell* c = &song->channels[ch].cells[row];
-        
-        if (strlen(c->sample) > 0 && c->note > 0) {
-            // Play WAV file with pitch shifting
-            pthread_mutex_lock(&audio_mutex);
-            
-            strcpy(sample_threads[ch].filename, c->sample);
-            sample_threads[ch].note = c->original_note;
-            sample_threads[ch].target_note = c->note;
-            sample_threads[ch].channel = ch;
-            sample_threads[ch].duration_ms = note_duration;
-            sample_threads[ch].pitch_ratio = c->pitch_ratio;
-            sample_threads[ch].active = 1;
-            
-            pthread_create(&sample_threads[ch].thread, NULL, play_sample_thread, &sample_threads[ch]);
-            pthread_detach(sample_threads[ch].thread); // Auto-cleanup on completion
-            
-            pthread_mutex_unlock(&audio_mutex);
-            
-            const char* note_name = midi_to_note_name(c->note);
-            const char* orig_name = midi_to_note_name(c->original_note);
-            printf("Ch%d:%s(SMP: %s->%s %.2fx) ", 
-                   ch, note_name, orig_name, note_name, c->pitch_ratio);
-            active_channels++;
-            
-        } else if (c->note > 0) {
-            // Play tone in separate thread
-            pthread_mutex_lock(&audio_mutex);
-            tone_threads[ch].freq = 440.0 * pow(2, (c->note - 69) / 12.0);
-            tone_threads[ch].duration_ms = note_duration;
-            tone_threads[ch].active = 1;
-            
-            pthread_create(&tone_threads[ch].thread, NULL, play_tone_thread, &tone_threads[ch]);
-            pthread_detach(tone_threads[ch].thread); // Auto-cleanup on completion
-            
-            pthread_mutex_unlock(&audio_mutex);
-            
-            const char* note_name = midi_to_note_name(c->note);
-            printf("Ch%d:%s ", ch, note_name);
-            active_channels++;
+    engine_publish(song);
+    engine_send(&cmd);
+}
+
+// ---- Play a single pattern row (row preview) ----
+void engine_preview(Song* song, int pattern, int row) {
+    EngineCommand cmd = {.type = CMD_PREVIEW, .pos = {-1, pattern, row}};
+    engine_publish(song);
+    engine_send(&cmd);
+}
+
+// ---- Sound a cell on a channel for 'frames' (0 = until note off) ----
+void engine_note_on(Song* song, int channel, const Cell* cell, Uint32 frames) {
+    EngineCommand cmd = {.type = CMD_NOTE_ON, .channel = channel, .cell = *cell, .frames = frames};
+    engine_publish(song); // The cell may name a new instrument
+    engine_send(&cmd);
+}
+
+// ---- Silence a channel started by engine_note_on() ----
+void engine_note_off(int channel) {
+    EngineCommand cmd = {.type = CMD_NOTE_OFF, .channel = channel};
+    engine_send(&cmd);
+}
+
+// ---- Change the tempo of the playing song without copying it ----
+void engine_tempo(int bpm) {
+    EngineCommand cmd = {.type = CMD_TEMPO, .row = bpm};
+    engine_send(&cmd);
+}
+
+// ---- Read the sequencer position for the UI ----
+void engine_status(int* row, int* loop_count, int* finished) {
+    *row = __atomic_load_n(&engine.current_row, __ATOMIC_RELAXED);
+    *loop_count = __atomic_load_n(&engine.loop_count, __ATOMIC_RELAXED);
+    *finished = __atomic_load_n(&engine.finished, __ATOMIC_RELAXED);
+}
+
+// ---- Snapshot of the playback counters for the UI ----
+void engine_stats_read(EngineStats* out) {
+    const EngineStats* st = &engine.stats;
+    
+    out->callbacks = __atomic_load_n(&st->callbacks, __ATOMIC_RELAXED);
+    out->xruns = __atomic_load_n(&st->xruns, __ATOMIC_RELAXED);
+    out->time_total = __atomic_load_n(&st->time_total, __ATOMIC_RELAXED);
+    out->time_min = __atomic_load_n(&st->time_min, __ATOMIC_RELAXED);
+    out->time_max = __atomic_load_n(&st->time_max, __ATOMIC_RELAXED);
+    out->budget = __atomic_load_n(&st->budget, __ATOMIC_RELAXED);
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        out->hist[i] = __atomic_load_n(&st->hist[i], __ATOMIC_RELAXED);
+    }
+    out->voices = __atomic_load_n(&st->voices, __ATOMIC_RELAXED);
+    out->voices_peak = __atomic_load_n(&st->voices_peak, __ATOMIC_RELAXED);
+    out->queue_peak = __atomic_load_n(&st->queue_peak, __ATOMIC_RELAXED);
+}
+
+// ---- 99th percentile callback time in microseconds, from the histogram ----
+// Reported as the top of its bucket, so it errs on the slow side.
+Uint32 engine_stats_p99(const EngineStats* st) {
+    Uint64 count = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) count += st->hist[i];
+    if (count == 0) return 0;
+    
+    Uint64 seen = 0;
+    for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+        seen += st->hist[i];
+        if (seen * 100 >= count * 99) {
+            Uint32 top = stats_bucket_top(i);
+            return top < st->time_max ? top : st->time_max;
         }
     }
+    return st->time_max;
+}
+
+// ---- Append the counters of the last playback to the stats CSV ----
+// Only when CTRACKER_STATS_CSV names a file; the header is written once.
+void engine_stats_log(const Song* song) {
+    const char* path = getenv(STATS_CSV_ENV);
+    if (!path || !path[0]) return;
+    
+    EngineStats st;
+    engine_stats_read(&st);
+    if (st.callbacks == 0) return;
+    
+    FILE* f = fopen(path, "a");
+    if (!f) {
+        printf("Error: Could not open %s for stats\n", path);
+        return;
+    }
+    if (ftell(f) == 0) {
+        fprintf(f, "time,bpm,buffer_frames,callbacks,budget_us,min_us,mean_us,p99_us,max_us,"
+                   "xruns,voices_peak,queue_peak,sample_hits,sample_misses\n");
+    }
+    fprintf(f, "%ld,%d,%d,%llu,%u,%u,%llu,%u,%u,%llu,%d,%d,%llu,%llu\n",
+            (long)time(NULL), song->bpm, ENGINE_BUFFER_FRAMES,
+            (unsigned long long)st.callbacks, st.budget, st.time_min,
+            (unsigned long long)(st.time_total / st.callbacks), engine_stats_p99(&st), st.time_max,
+            (unsigned long long)st.xruns, st.voices_peak, st.queue_peak,
+            (unsigned long long)sample_bank_hits, (unsigned long long)sample_bank_misses);
+    fclose(f);
+}
+
+// ---- Stop the sequencer and silence all voices ----
+void engine_stop_all(void) {
+    EngineCommand cmd = {.type = CMD_STOP};
+    engine_send(&cmd);
+}
+
+// ---- MIDI input ----
+// Messages are turned into commands on engine.midi, stamped with when
+// they arrived. Notes play the tracker channel of their MIDI channel;
+// clock, start, continue, stop and song position slave the sequencer.
+typedef struct {
+    int open;                   // Input is running (UI thread)
+    int quit;                   // Asks the input thread to finish
+    int patch[MAX_CHANNELS];    // Instrument << 8 | base note a channel plays notes with (UI writes)
+    int channels;               // Channels of the song, so notes beyond them are dropped (UI writes)
+    Uint64 epoch;               // Performance counter that clock times count from
+    
+    // Clock, input thread only: a delay-locked loop smooths the tick times
+    int ticks;                  // Ticks since the sequencer started (-1 = stopped)
+    int position;               // Song row that tick 0 plays
+    double tick_time;           // Smoothed time of the last tick (s)
+    double period;              // Smoothed tick period (s)
+    double last_tick;           // Arrival of the last tick (s, 0 = none yet)
+    int locked;                 // 'period' has been measured since the clock restarted
+    
+    // Byte parser, for backends that hand over raw MIDI
+    Uint8 status;               // Running status (0 = none)
+    Uint8 data[2];
+    int count;
+    
+    // Read by the UI, written atomically by the input thread
+    Uint64 clock_seen;          // Performance counter at the last tick
+    int bpm_x10;                // Tempo of the clock in tenths of a BPM
+    Uint64 dropped;             // Events lost to a full queue
+    
+#if MIDI_HAVE_ALSA
+    snd_seq_t* seq;
+    pthread_t thread;
+#elif MIDI_HAVE_COREMIDI
+    MIDIClientRef client;
+    MIDIPortRef port;
+#endif
+} MidiInput;
+
+MidiInput midi;
+
+// ---- Queue a command for the audio thread, due at performance counter 'time' ----
+void midi_push(MidiInput* m, EngineCommand* cmd, Uint64 time) {
+    cmd->time = time;
+    if (!queue_push(&engine.midi, cmd)) __atomic_add_fetch(&m->dropped, 1, __ATOMIC_RELAXED);
+}
+
+// ---- Follow a clock tick (input thread) ----
+// Second-order delay-locked loop: the tick times and the period are
+// pulled towards what arrives at MIDI_CLOCK_BANDWIDTH, so jitter in
+// the arrival times never reaches the rows.
+void midi_clock_tick(MidiInput* m, Uint64 now) {
+    double freq = (double)SDL_GetPerformanceFrequency();
+    double t = (double)(now - m->epoch) / freq;
     
-    if (active_channels == 0) {
-        printf("--- rest ---");
+    if (m->last_tick <= 0 || t - m->last_tick > 0.5) {
+        // First tick, or the clock stalled: start again from this one
+        if (m->period <= 0) m->period = 60.0 / (120 * 24);
+        m->tick_time = t;
+        m->locked = 0;
+    } else if (!m->locked) {
+        m->period = t - m->last_tick;
+        m->tick_time = t;
+        m->locked = 1;
+    } else {
+        double omega = 2.0 * M_PI * MIDI_CLOCK_BANDWIDTH * m->period;
+        double e = t - (m->tick_time + m->period);
+        m->tick_time += m->period + sqrt(2.0) * omega * e;
+        m->period += omega * omega * e;
     }
-    printf("\n");
     
-    // Wait for note duration
-    SDL_Delay(note_duration);
+    // MIN_BPM to MAX_BPM, as the tracker allows
+    if (m->period < 60.0 / (MAX_BPM * 24)) m->period = 60.0 / (MAX_BPM * 24);
+    if (m->period > 60.0 / (MIN_BPM * 24)) m->period = 60.0 / (MIN_BPM * 24);
+    m->last_tick = t;
+    __atomic_store_n(&m->clock_seen, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->bpm_x10, (int)(25.0 / m->period + 0.5), __ATOMIC_RELAXED);
+    
+    // Every sixth tick starts a row, at the smoothed time of the tick
+    if (m->ticks < 0) return;
+    if (m->ticks++ % MIDI_TICKS_PER_ROW == 0) {
+        EngineCommand cmd = {.type = CMD_CLOCK};
+        cmd.frames = (Uint32)(m->period * MIDI_TICKS_PER_ROW * SAMPLE_RATE + 0.5);
+        midi_push(m, &cmd, m->epoch + (Uint64)(m->tick_time * freq));
+    }
 }
 
-// ---- Play entire song with loop support ----
-void play_song(Song* song) {
-    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
-        printf("SDL_Init error: %s\n", SDL_GetError());
-        return;
+// ---- Handle one complete message (input thread) ----
+void midi_message(MidiInput* m, const Uint8* msg, Uint64 now) {
+    Uint8 type = msg[0] & 0xF0;
+    int channel = msg[0] & 0x0F;
+    
+    switch (msg[0]) {
+        case 0xF8: // Clock
+            midi_clock_tick(m, now);
+            return;
+        case 0xFA: // Start
+        case 0xFB: { // Continue
+            if (msg[0] == 0xFA) m->position = 0;
+            m->ticks = 0;
+            EngineCommand cmd = {.type = CMD_SYNC, .row = m->position};
+            midi_push(m, &cmd, now);
+            return;
+        }
+        case 0xFC: { // Stop: Continue carries on after the last row played
+            if (m->ticks >= 0) m->position += (m->ticks + MIDI_TICKS_PER_ROW - 1) / MIDI_TICKS_PER_ROW;
+            m->ticks = -1;
+            EngineCommand cmd = {.type = CMD_STOP};
+            midi_push(m, &cmd, now);
+            return;
+        }
+        case 0xF2: // Song position in sixteenths, which are rows
+            if (m->ticks < 0) m->position = msg[1] | msg[2] << 7;
+            return;
     }
     
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0) {
-        printf("Mix_OpenAudio error: %s\n", Mix_GetError());
-        SDL_Quit();
+    if (type == 0x90 && msg[2] > 0) {
+        if (channel >= __atomic_load_n(&m->channels, __ATOMIC_RELAXED)) return;
+        int patch = __atomic_load_n(&m->patch[channel], __ATOMIC_RELAXED);
+        EngineCommand cmd = {.type = CMD_NOTE_ON, .channel = channel};
+        cmd.cell.note = msg[1];
+        cmd.cell.original_note = patch & 0xFF;
+        cmd.cell.instrument = (Uint16)(patch >> 8);
+        cmd.cell.pitch_ratio = cmd.cell.original_note > 0 ? calculate_pitch_ratio(cmd.cell.original_note, msg[1]) : 1.0f;
+        midi_push(m, &cmd, now);
+    } else if (type == 0x80 || type == 0x90) {
+        EngineCommand cmd = {.type = CMD_NOTE_OFF, .channel = channel};
+        cmd.cell.note = msg[1];
+        midi_push(m, &cmd, now);
+    }
+}
+
+// ---- Feed one raw MIDI byte (input thread) ----
+// Real-time bytes may arrive in the middle of another message; system
+// exclusive data is skipped, and running status is kept for channel
+// messages.
+void midi_parse(MidiInput* m, Uint8 byte, Uint64 now) {
+    if (byte >= 0xF8) {
+        Uint8 msg[3] = {byte, 0, 0};
+        midi_message(m, msg, now);
+        return;
+    }
+    if (byte & 0x80) {
+        // Of the system common messages only song position is read
+        m->status = byte < 0xF0 || byte == 0xF2 ? byte : 0;
+        m->count = 0;
         return;
     }
+    if (m->status == 0) return;
     
-    // Allocate 8 channels for SDL_mixer
-    Mix_AllocateChannels(8);
+    m->data[m->count++] = byte;
+    Uint8 type = m->status & 0xF0;
+    if (m->count < (type == 0xC0 || type == 0xD0 ? 1 : 2)) return;
     
-    int note_duration = get_note_duration_ms(song);
-    printf("Playing... BPM: %d, Note duration: %dms\n", song->bpm, note_duration);
+    Uint8 msg[3] = {m->status, m->data[0], m->count > 1 ? m->data[1] : 0};
+    m->count = 0;
+    if (m->status == 0xF2) m->status = 0;
+    midi_message(m, msg, now);
+}
+
+#if MIDI_HAVE_ALSA
+// ---- ALSA sequencer input thread ----
+void* midi_thread(void* arg) {
+    MidiInput* m = (MidiInput*)arg;
+    int count = snd_seq_poll_descriptors_count(m->seq, POLLIN);
+    struct pollfd fds[count > 0 ? count : 1];
+    snd_seq_poll_descriptors(m->seq, fds, count, POLLIN);
     
-    if (song->loop_enabled) {
-        printf("Loop enabled: rows %d to %d\n", song->loop_start, song->loop_end);
+    while (!__atomic_load_n(&m->quit, __ATOMIC_RELAXED)) {
+        // Wake up now and then to see if it is time to quit
+        if (poll(fds, count, 100) <= 0) continue;
+        
+        snd_seq_event_t* ev;
+        while (snd_seq_event_input(m->seq, &ev) >= 0 && ev) {
+            Uint64 now = SDL_GetPerformanceCounter();
+            Uint8 msg[3] = {0, 0, 0};
+            switch (ev->type) {
+                case SND_SEQ_EVENT_NOTEON:
+                case SND_SEQ_EVENT_NOTEOFF:
+                    msg[0] = (ev->type == SND_SEQ_EVENT_NOTEON ? 0x90 : 0x80) | (ev->data.note.channel & 0x0F);
+                    msg[1] = ev->data.note.note & 0x7F;
+                    msg[2] = ev->data.note.velocity & 0x7F;
+                    break;
+                case SND_SEQ_EVENT_CLOCK: msg[0] = 0xF8; break;
+                case SND_SEQ_EVENT_START: msg[0] = 0xFA; break;
+                case SND_SEQ_EVENT_CONTINUE: msg[0] = 0xFB; break;
+                case SND_SEQ_EVENT_STOP: msg[0] = 0xFC; break;
+                case SND_SEQ_EVENT_SONGPOS:
+                    msg[0] = 0xF2;
+                    msg[1] = ev->data.control.value & 0x7F;
+                    msg[2] = ev->data.control.value >> 7 & 0x7F;
+                    break;
+                default:
+                    continue;
+            }
+            midi_message(m, msg, now);
+        }
     }
-    printf("Press any key to stop...\n");
+    return NULL;
+}
+#elif MIDI_HAVE_COREMIDI
+// ---- CoreMIDI input, called on CoreMIDI's own thread ----
+void midi_read_proc(const MIDIPacketList* list, void* ref, void* source) {
+    MidiInput* m = (MidiInput*)ref;
+    Uint64 now = SDL_GetPerformanceCounter();
+    const MIDIPacket* packet = &list->packet[0];
+    (void)source;
     
-    // Initialize thread data
-    for (int i = 0; i < MAX_CHANNELS; i++) {
-        tone_threads[i].active = 0;
-        tone_threads[i].freq = 0;
-        sample_threads[i].active = 0;
-        sample_threads[i].filename[0] = '\0';
+    for (UInt32 i = 0; i < list->numPackets; i++) {
+        for (UInt16 k = 0; k < packet->length; k++) midi_parse(m, packet->data[k], now);
+        packet = MIDIPacketNext(packet);
     }
+}
+
+// ---- Does a CoreMIDI source's name contain 'name'? ----
+int midi_source_matches(MIDIEndpointRef source, const char* name) {
+    CFStringRef prop = NULL;
+    char text[256] = "";
     
-    global_playing = 1;
+    if (MIDIObjectGetStringProperty(source, kMIDIPropertyName, &prop) != noErr || !prop) return 0;
+    CFStringGetCString(prop, text, sizeof(text), kCFStringEncodingUTF8);
+    CFRelease(prop);
+    return strstr(text, name) != NULL;
+}
+#endif
+
+// ---- Start MIDI input; returns 0 if it is not built in or fails ----
+// MIDI_SOURCE_ENV names a port to take input from: an ALSA address
+// such as "20:0", or part of a CoreMIDI source name. With CoreMIDI
+// every source is taken when it is not set; with ALSA other programs
+// connect to the "CTracker In" port.
+int midi_open(void) {
+    const char* source = getenv(MIDI_SOURCE_ENV);
     
-    // Save original terminal settings
-    struct termios oldt, newt;
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    midi.quit = 0;
+    midi.ticks = -1;
+    midi.position = 0;
+    midi.last_tick = 0;
+    midi.status = 0;
+    midi.epoch = SDL_GetPerformanceCounter();
     
-    // Play all rows with loop support
-    int current_row = 0;
-    int loop_count = 0;
+#if MIDI_HAVE_ALSA
+    if (snd_seq_open(&midi.seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0) {
+        printf("MIDI: could not open the ALSA sequencer\n");
+        return 0;
+    }
+    snd_seq_set_client_name(midi.seq, "CTracker");
+    int port = snd_seq_create_simple_port(midi.seq, "CTracker In",
+                                          SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_addr_t from;
+    if (port >= 0 && source && source[0] &&
+        (snd_seq_parse_address(midi.seq, &from, source) < 0 ||
+         snd_seq_connect_from(midi.seq, port, from.client, from.port) < 0)) {
+        printf("MIDI: could not connect to %s\n", source);
+    }
+    if (port < 0 || pthread_create(&midi.thread, NULL, midi_thread, &midi) != 0) {
+        printf("MIDI: could not start input\n");
+        snd_seq_close(midi.seq);
+        return 0;
+    }
+    midi.open = 1;
+#elif MIDI_HAVE_COREMIDI
+    if (MIDIClientCreate(CFSTR("CTracker"), NULL, NULL, &midi.client) != noErr ||
+        MIDIInputPortCreate(midi.client, CFSTR("CTracker In"), midi_read_proc, &midi, &midi.port) != noErr) {
+        printf("MIDI: could not start CoreMIDI input\n");
+        return 0;
+    }
+    ItemCount sources = MIDIGetNumberOfSources();
+    for (ItemCount i = 0; i < sources; i++) {
+        MIDIEndpointRef endpoint = MIDIGetSource(i);
+        if (source && source[0] && !midi_source_matches(endpoint, source)) continue;
+        MIDIPortConnectSource(midi.port, endpoint, NULL);
+    }
+    midi.open = 1;
+#else
+    (void)source;
+#endif
+    return midi.open;
+}
+
+// ---- Stop MIDI input ----
+void midi_close(void) {
+    if (!midi.open) return;
     
-    while (global_playing) {
-        play_row(song, current_row);
-        
-        // Check if a key was pressed
-        if (kbhit()) {
-            getchar(); // Read the pressed key
-            global_playing = 0;
-            printf("\nPlayback stopped\n");
-            break;
+#if MIDI_HAVE_ALSA
+    __atomic_store_n(&midi.quit, 1, __ATOMIC_RELAXED);
+    pthread_join(midi.thread, NULL);
+    snd_seq_close(midi.seq);
+#elif MIDI_HAVE_COREMIDI
+    MIDIPortDispose(midi.port);
+    MIDIClientDispose(midi.client);
+#endif
+    midi.open = 0;
+}
+
+// ---- Give each channel's MIDI notes the instrument it plays at the cursor (UI thread) ----
+// That is the last note at or above the cursor row; a channel with none
+// plays the default instrument, and notes on channels the song does not
+// have are dropped.
+void midi_follow_cursor(const Song* song, int pattern, int row) {
+    for (int ch = 0; ch < song->num_channels; ch++) {
+        int patch = 0;
+        for (int r = row; r >= 0; r--) {
+            const Cell* c = song_cell(song, pattern, r, ch);
+            if (c->note > 0) {
+                patch = c->instrument << 8 | c->original_note;
+                break;
+            }
         }
+        __atomic_store_n(&midi.patch[ch], patch, __ATOMIC_RELAXED);
+    }
+    for (int ch = song->num_channels; ch < MAX_CHANNELS; ch++) {
+        __atomic_store_n(&midi.patch[ch], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&midi.channels, song->num_channels, __ATOMIC_RELAXED);
+}
+
+// ---- Start composing a frame the size of the terminal ----
+void screen_begin(void) {
+    struct winsize ws;
+    int cols = 80, rows = 24;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+        cols = ws.ws_col;
+        rows = ws.ws_row;
+    }
+    rows--; // Keep the last line for prompts
+    if (cols < 20) cols = 20;
+    if (rows < TTY_CHROME_LINES + 1) rows = TTY_CHROME_LINES + 1;
+    
+    if (cols != screen.cols || rows != screen.rows || !screen.frame) {
+        char* frame = realloc(screen.frame, (size_t)cols * rows);
+        char* shown = frame ? realloc(screen.shown, (size_t)cols * rows) : NULL;
+        if (frame) screen.frame = frame;
+        if (shown) screen.shown = shown;
+        if (!frame || !shown) {
+            screen.cols = screen.rows = 0;
+            return;
+        }
+        screen.cols = cols;
+        screen.rows = rows;
+        screen.valid = 0;
+    }
+    
+    memset(screen.frame, ' ', (size_t)screen.cols * screen.rows);
+    screen.x = screen.y = screen.used = 0;
+}
+
+// ---- Forget what the terminal shows; the next flush redraws everything ----
+void screen_invalidate(void) {
+    screen.valid = 0;
+}
+
+// ---- Compose text into the frame; lines are clipped to the frame ----
+void screen_printf(const char* fmt, ...) {
+    char text[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    
+    for (const char* c = text; *c; c++) {
+        if (*c == '\n') {
+            screen.y++;
+            screen.x = 0;
+            continue;
+        }
+        if (screen.y < screen.rows && screen.x < screen.cols) {
+            screen.frame[screen.y * screen.cols + screen.x] = *c;
+        }
+        screen.x++;
+    }
+    
+    int lines = screen.y + (screen.x > 0);
+    if (lines > screen.rows) lines = screen.rows;
+    if (lines > screen.used) screen.used = lines;
+}
+
+// ---- Append output for the next flush ----
+void screen_emit(const char* text, size_t len) {
+    if (screen.out_len + len > screen.out_cap) {
+        size_t cap = screen.out_cap ? screen.out_cap : 4096;
+        while (cap < screen.out_len + len) cap *= 2;
+        char* out = realloc(screen.out, cap);
+        if (!out) return;
+        screen.out = out;
+        screen.out_cap = cap;
+    }
+    memcpy(screen.out + screen.out_len, text, len);
+    screen.out_len += len;
+}
+
+// ---- Write the changed parts of the frame with one write ----
+void screen_flush(void) {
+    char move[32];
+    screen.out_len = 0;
+    if (screen.cols == 0) return;
+    
+    if (!screen.valid) {
+        screen_emit("\x1b[H\x1b[2J", 7);
+        memset(screen.shown, ' ', (size_t)screen.cols * screen.rows);
+    }
+    
+    for (int y = 0; y < screen.rows; y++) {
+        const char* want = &screen.frame[y * screen.cols];
+        char* have = &screen.shown[y * screen.cols];
         
-        // Move to next row
-        current_row++;
-        
-        // Handle loop
-        if (song->loop_enabled) {
-            if (current_row > song->loop_end) {
-                current_row = song->loop_start;
-                loop_count++;
-                printf("Loop %d\n", loop_count);
+        int x = 0;
+        while (x < screen.cols) {
+            if (want[x] == have[x]) {
+                x++;
+                continue;
             }
-        } else {
-            // No loop - stop at end of pattern
-            if (current_row >= song->num_rows) {
-                break;
+            
+            // Runs separated by a few unchanged characters are cheaper
+            // to rewrite than to jump over
+            int end = x + 1, last = x;
+            while (end < screen.cols && end - last <= 4) {
+                if (want[end] != have[end]) last = end;
+                end++;
             }
+            
+            int len = snprintf(move, sizeof(move), "\x1b[%d;%dH", y + 1, x + 1);
+            screen_emit(move, len);
+            screen_emit(want + x, last + 1 - x);
+            memcpy(have + x, want + x, last + 1 - x);
+            x = last + 1;
         }
     }
     
-    // Restore terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+    // Nothing to write if the frame did not change
+    if (screen.valid && screen.out_len == 0) return;
+    
+    // Leave the terminal cursor below the frame for prompts
+    int len = snprintf(move, sizeof(move), "\x1b[%d;1H", screen.used + 1);
+    screen_emit(move, len);
+    
+    fwrite(screen.out, 1, screen.out_len, stdout);
+    fflush(stdout);
+    screen.valid = 1;
+}
+
+// ---- TTY display: compose the pattern view into the screen frame ----
+// 'play_row' marks the playhead (-1 = not playing), 'cursor_row' -1
+// hides the cursor. The view scrolls to keep the cursor, or the
+// playhead, inside the terminal.
+void draw_tty(Song* song, int pattern, int cursor_row, int cursor_channel, int play_row) {
+    screen_begin();
+    screen_printf("CTracker (TTY) | BPM: %d", song->bpm);
     
-    // Stop all playback
-    for (int i = 0; i < MAX_CHANNELS; i++) {
-        pthread_mutex_lock(&audio_mutex);
-        tone_threads[i].active = 0;
-        sample_threads[i].active = 0;
-        pthread_mutex_unlock(&audio_mutex);
+    // Display loop status
+    if (song->loop_enabled) {
+        screen_printf(" | LOOP: %d-%d", song->loop_start, song->loop_end);
+    } else {
+        screen_printf(" | LOOP: OFF");
+    }
+    screen_printf("\n");
+    
+    // Pattern being edited and the order list
+    screen_printf("Pattern %d/%d | Order:", pattern, song->num_patterns - 1);
+    for (int i = 0; i < song->num_orders; i++) {
+        screen_printf(i < 16 ? " %d" : " ...", song->order[i]);
+        if (i == 16) break;
     }
+    screen_printf("\n\n");
     
-    // Wait for all threads to finish
-    SDL_Delay(100);
+    // Rows and channels that fit on the terminal
+    int num_rows = song->patterns[pattern].num_rows;
+    int view_rows = screen.rows - TTY_CHROME_LINES;
+    int focus = play_row >= 0 ? play_row : cursor_row;
+    int first_row = focus - view_rows / 2;
+    if (first_row > num_rows - view_rows) first_row = num_rows - view_rows;
+    if (first_row < 0) first_row = 0;
     
-    Mix_CloseAudio();
-    SDL_Quit();
-    printf("Playback finished. Total loops: %d\n", loop_count);
+    int view_channels = (screen.cols - 5) / 5;
+    if (view_channels < 1) view_channels = 1;
+    int first_channel = cursor_channel >= view_channels ? cursor_channel - view_channels + 1 : 0;
+    int last_channel = first_channel + view_channels;
+    if (last_channel > song->num_channels) last_channel = song->num_channels;
+    
+    // Channel number headers
+    screen_printf("    ");
+    for (int ch = first_channel; ch < last_channel; ch++) {
+        screen_printf("Ch%02d ", ch);
+    }
+    screen_printf("\n");
+    
+    // Separator line
+    screen_printf("   +");
+    for (int ch = first_channel; ch < last_channel; ch++) {
+        screen_printf("-----");
+    }
+    screen_printf("\n");
+    
+    // Loop markers are shown where the pattern first plays
+    int offset = song_pattern_offset(song, pattern);
+    
+    // Pattern rows
+    for (int r = first_row; r < num_rows && r < first_row + view_rows; r++) {
+        // Mark loop range
+        int song_row = offset < 0 ? -1 : offset + r;
+        if (song->loop_enabled && song_row == song->loop_start) screen_printf("[");
+        else if (song->loop_enabled && song_row == song->loop_end) screen_printf("]");
+        else screen_printf(" ");
+        
+        screen_printf(r == play_row ? "%02d *" : "%02d |", r);
+        for (int ch = first_channel; ch < last_channel; ch++) {
+            if (r == cursor_row && ch == cursor_channel) screen_printf(">");
+            else screen_printf(" ");
+            
+            Cell* c = song_cell(song, pattern, r, ch);
+            if (c->note > 0) {
+                const char* note_name = midi_to_note_name(c->note);
+                screen_printf("%-4s", note_name);
+            } else {
+                screen_printf("%-4s", REST_NAME);
+            }
+        }
+        screen_printf("\n");
+    }
+}
+
+// ---- Playback status line ----
+void draw_status(Song* song, int play_row, int loops) {
+    // MIDI input, with the tempo of its clock while one is running
+    char input[48] = "";
+    Uint64 seen = __atomic_load_n(&midi.clock_seen, __ATOMIC_RELAXED);
+    if (midi.open && seen && SDL_GetPerformanceCounter() - seen < SDL_GetPerformanceFrequency() / 2) {
+        snprintf(input, sizeof(input), " | MIDI clock %.1f BPM", __atomic_load_n(&midi.bpm_x10, __ATOMIC_RELAXED) / 10.0);
+    } else if (midi.open) {
+        snprintf(input, sizeof(input), " | MIDI in");
+    }
+    
+    SongPos pos;
+    if (play_row < 0 || !song_pos_at(song, play_row, &pos)) {
+        screen_printf(engine.device ? "\nStopped%s\n" : "\nStopped (audio device is not available)%s\n", input);
+        return;
+    }
+    
+    screen_printf("\nPlaying order %d, pattern %d, row %02d", pos.order, pos.pattern, pos.row);
+    if (song->loop_enabled) {
+        screen_printf(" | Loop %d-%d, pass %d", song->loop_start, song->loop_end, loops + 1);
+    }
+    screen_printf("%s\n", input);
+}
+
+// ---- Engine counters: min/mean/p99 callback time against the buffer budget ----
+void draw_engine_stats(void) {
+    EngineStats st;
+    engine_stats_read(&st);
+    if (engine.device == 0 || st.callbacks == 0) {
+        screen_printf("\n");
+        return;
+    }
+    
+    Uint64 lookups = sample_bank_hits + sample_bank_misses;
+    screen_printf("Audio %.2f/%.2f/%.2f of %.1f ms | xrun %llu | voices %d/%d | queue %u/%d | cache %d%%\n",
+                  st.time_min / 1000.0, (double)st.time_total / st.callbacks / 1000.0,
+                  engine_stats_p99(&st) / 1000.0, st.budget / 1000.0,
+                  (unsigned long long)st.xruns, st.voices, st.voices_peak,
+                  queue_depth(&engine.commands), st.queue_peak,
+                  lookups ? (int)(sample_bank_hits * 100 / lookups) : 100);
+}
+
+// ---- Controls below the pattern view ----
+void draw_controls(Song* song, int pattern) {
+    screen_printf("\nWASD move  E edit  R play row  P play/stop  [ ] pattern  O order  C effects\n");
+    screen_printf("N resize (%d rows, %d ch)  B BPM  L loop  F save  G load  X export  Q quit\n",
+                  song->patterns[pattern].num_rows, song->num_channels);
+    screen_printf("Notes: C4, A#3, F-1, '---' for rest; samples are pitch-shifted to the note\n");
+}
+
+// ---- Edit cell ----
+void edit_cell(Song* song, int pattern, int row, int channel) {
+    char input[64];
+    char sample[64];
+    int original_note = 60; // Default C4 for new samples
+    Cell* cell = song_cell(song, pattern, row, channel);
+    Instrument* current = &song->instruments[cell->instrument];
+    
+    printf("Current note: ");
+    if (cell->note > 0) {
+        printf("%s", midi_to_note_name(cell->note));
+    } else {
+        printf("--- (rest)");
+    }
+    printf("\n");
+    
+    // Check if there's already a sample
+    if (current->wave < 0) {
+        printf("Current sample: %s (base note: %s)\n", 
+               current->name,
+               midi_to_note_name(cell->original_note));
+        original_note = cell->original_note;
+    }
+    
+    printf("Enter note (e.g., C4, A#3, F-1) or '---' for rest: ");
+    fgets(input, sizeof(input), stdin);
+    input[strcspn(input, "\n")] = 0; // remove \n
+    
+    printf("Enter WAV file, or sine/square/saw (leave empty for sine): ");
+    fgets(sample, sizeof(sample), stdin);
+    sample[strcspn(sample, "\n")] = 0; // remove \n
+    
+    int note = note_name_to_midi(input);
+    
+    // If a new sample is provided, ask for its original note
+    if (strlen(sample) > 0 && waveform_by_name(sample) < 0 && note > 0) {
+        char orig_note_input[64];
+        printf("What is the original note of this sample? (e.g., C4): ");
+        fgets(orig_note_input, sizeof(orig_note_input), stdin);
+        orig_note_input[strcspn(orig_note_input, "\n")] = 0;
+        
+        original_note = note_name_to_midi(orig_note_input);
+        if (original_note <= 0) original_note = 60; // Default to C4
+    } else if (strlen(sample) == 0 && current->wave < 0) {
+        // Keep original note if sample stays the same
+        original_note = cell->original_note;
+    }
+    
+    // Instruments are shared by name. Re-entering the cell's own file
+    // decodes it again, so edits to the WAV on disk are picked up.
+    int ins = song_instrument(song, sample);
+    if (ins < 0) {
+        printf("Error: Could not add instrument %s\n", sample);
+        return;
+    }
+    if (ins == cell->instrument) {
+        instrument_reload(&song->instruments[ins]);
+    }
+    
+    cell->note = note;
+    cell->original_note = original_note;
+    cell->instrument = ins;
+    song_sweep_instruments(song); // The cell's old instrument may now be unused
+    
+    // Calculate pitch ratio
+    if (note > 0 && original_note > 0) {
+        cell->pitch_ratio = calculate_pitch_ratio(original_note, note);
+    } else {
+        cell->pitch_ratio = 1.0f;
+    }
+    
+    // Let the edit be heard for one row
+    if (note > 0) engine_note_on(song, channel, cell, row_clock_total(song->bpm, 1));
+    
+    printf("Set to: ");
+    if (note > 0) {
+        printf("%s", midi_to_note_name(note));
+        if (waveform_by_name(sample) >= 0) {
+            printf(" (%s)", sample);
+        } else if (strlen(sample) > 0) {
+            printf(" (sample: %s, original: %s, pitch: %.3fx)", 
+                   sample, 
+                   midi_to_note_name(original_note),
+                   cell->pitch_ratio);
+        }
+    } else {
+        printf("--- (rest)");
+    }
+    printf("\n");
+}
+
+// ---- Non-blocking input check (simplified version) ----
+int kbhit() {
+    struct timeval tv = {0L, 0L};
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    return select(1, &fds, NULL, NULL, &tv);
+}
+
+// ---- Wait up to timeout_ms for a key press ----
+int wait_for_key(int timeout_ms) {
+    struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    return select(1, &fds, NULL, NULL, &tv);
+}
+
+// ---- Read a key without Enter; 0 if none arrives within timeout_ms ----
+int poll_key(int timeout_ms) {
+    struct termios oldt, newt;
+    tcgetattr(STDIN_FILENO, &oldt);
+    newt = oldt;
+    newt.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    int ch = wait_for_key(timeout_ms) > 0 ? getchar() : 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+    return ch;
 }
 
 // ---- Change BPM ----
 void change_bpm(Song* song) {
     int new_bpm;
     printf("Current BPM: %d\n", song->bpm);
-    printf("Enter new BPM (20-300): ");
+    printf("Enter new BPM (%d-%d): ", MIN_BPM, MAX_BPM);
     scanf("%d", &new_bpm);
     getchar(); // remove newline character
     
-    if (new_bpm >= 20 && new_bpm <= 300) {
+    if (new_bpm >= MIN_BPM && new_bpm <= MAX_BPM) {
         song->bpm = new_bpm;
-        // Update durations of all notes
-        for (int ch = 0; ch < song->num_channels; ch++) {
-            for (int row = 0; row < song->num_rows; row++) {
-                song->channels[ch].cells[row].duration_ms = get_note_duration_ms(song);
-            }
-        }
+        engine_tempo(new_bpm);
         printf("BPM changed to %d\n", song->bpm);
     } else {
         printf("Invalid BPM value\n");
@@ -646,16 +3251,18 @@ void set_loop(Song* song) {
     if (choice == 'y' || choice == 'Y') {
         song->loop_enabled = 1;
         
-        printf("Enter loop start row (0-%d): ", song->num_rows - 1);
+        // Rows count across the whole order list
+        int length = song_length(song);
+        printf("Enter loop start row (0-%d): ", length - 1);
         scanf("%d", &start);
         getchar();
         
-        printf("Enter loop end row (%d-%d): ", start + 1, song->num_rows - 1);
+        printf("Enter loop end row (%d-%d): ", start + 1, length - 1);
         scanf("%d", &end);
         getchar();
         
         // Validate loop points
-        if (start >= 0 && start < end && end < song->num_rows) {
+        if (start >= 0 && start < end && end < length) {
             song->loop_start = start;
             song->loop_end = end;
             printf("Loop set to rows %d-%d\n", start, end);
@@ -669,287 +3276,1203 @@ void set_loop(Song* song) {
     }
 }
 
-// ---- Play current row (for testing) ----
-void play_current_row(Song* song, int row) {
-    printf("Playing row %d...\n", row);
+// ---- Edit the effects of a channel ----
+void edit_channel_fx(Song* song, int channel) {
+    ChannelFx* fx = &song->fx[channel];
+    float* values[] = {&fx->volume, &fx->pan, &fx->cutoff, &fx->delay_ms,
+                       &fx->feedback, &fx->delay_mix, &fx->send};
+    const char* names[] = {"Volume (0-2)", "Pan (-1 left to 1 right)", "Low-pass cutoff in Hz (0 = off)",
+                           "Delay in ms (0 = off)", "Delay feedback (0-0.95)", "Delay level (0-1)",
+                           "Reverb send (0-1)"};
+    const float lo[] = {0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    const float hi[] = {2.0f, 1.0f, SAMPLE_RATE / 2, FX_DELAY_MAX_MS, 0.95f, 1.0f, 1.0f};
+    char input[64];
     
-    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
-        printf("SDL_Init error: %s\n", SDL_GetError());
-        return;
+    printf("Effects of channel %d (Enter keeps a value)\n", channel);
+    for (int i = 0; i < 7; i++) {
+        float value;
+        printf("%s [%g]: ", names[i], *values[i]);
+        if (!fgets(input, sizeof(input), stdin)) break;
+        if (input[strspn(input, " \t\r\n")] == 0) continue;
+        
+        if (sscanf(input, "%f", &value) == 1 && value >= lo[i] && value <= hi[i]) {
+            *values[i] = value;
+        } else {
+            printf("Invalid value, kept %g\n", *values[i]);
+        }
     }
+    printf(channel_fx_active(fx) ? "Channel %d runs through its effects\n"
+                                 : "Channel %d has no effects beyond volume and pan\n", channel);
+}
+
+// ---- Resize the pattern ----
+void resize_pattern(Song* song, int pattern) {
+    char input[16];
+    int rows = song->patterns[pattern].num_rows, channels = song->num_channels;
     
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0) {
-        printf("Mix_OpenAudio error: %s\n", Mix_GetError());
-        SDL_Quit();
-        return;
+    printf("Enter number of rows (Enter to keep %d): ", rows);
+    fgets(input, sizeof(input), stdin);
+    if (input[0] != '\n' && input[0] != '\0') rows = atoi(input);
+    
+    printf("Enter number of channels, 1-%d (Enter to keep %d): ", MAX_CHANNELS, channels);
+    fgets(input, sizeof(input), stdin);
+    if (input[0] != '\n' && input[0] != '\0') channels = atoi(input);
+    
+    if (rows < 1 || channels < 1 || channels > MAX_CHANNELS) {
+        printf("Invalid pattern size\n");
+    } else if (!song_resize(song, pattern, channels, rows)) {
+        printf("Error: Could not allocate pattern\n");
+    } else {
+        song_sweep_instruments(song);
+        printf("Pattern is now %d rows x %d channels\n", rows, channels);
+    }
+}
+
+// ---- Edit the order list ----
+void edit_order(Song* song) {
+    char input[1024];
+    int order[512];
+    int count = 0;
+    
+    printf("Current order:");
+    for (int i = 0; i < song->num_orders; i++) printf(" %d", song->order[i]);
+    printf("\n");
+    
+    printf("Enter pattern numbers 0-%d, separated by spaces: ", song->num_patterns - 1);
+    fgets(input, sizeof(input), stdin);
+    
+    // Stop at the first token that is not a number
+    char* p = input;
+    char* end;
+    while (count < 512) {
+        long v = strtol(p, &end, 10);
+        if (end == p) break;
+        order[count++] = (int)v;
+        p = end;
+    }
+    
+    if (count == 0) {
+        printf("Order unchanged\n");
+    } else if (!song_set_order(song, order, count)) {
+        printf("Invalid order list\n");
+    } else {
+        printf("Order set: %d entries, %d rows\n", count, song_length(song));
+    }
+}
+
+// ---- Bump allocator for scratch buffers ----
+// Reserved once for a job and handed out without locking, so a job
+// that fits what an earlier one reserved makes no heap calls at all.
+typedef struct {
+    char* base;         // Reserved memory, ARENA_ALIGN aligned
+    char* block;        // As returned by malloc()
+    size_t size;        // Bytes reserved
+    size_t used;        // Bytes handed out since the last reserve
+} Arena;
+
+// ---- Bytes an allocation takes up in an arena ----
+size_t arena_round(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+// ---- Empty the arena and make sure it holds 'size' bytes; returns 0 if out of memory ----
+int arena_reserve(Arena* arena, size_t size) {
+    arena->used = 0;
+    if (size <= arena->size) return 1;
+    
+    free(arena->block);
+    arena->block = malloc(size + ARENA_ALIGN);
+    arena->size = arena->block ? size : 0;
+    arena->base = (char*)(((uintptr_t)arena->block + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    return arena->block != NULL;
+}
+
+// ---- Hand out 'size' bytes; NULL if the reserve is used up ----
+void* arena_alloc(Arena* arena, size_t size) {
+    size = arena_round(size);
+    if (size > arena->size - arena->used) return NULL;
+    
+    void* p = arena->base + arena->used;
+    arena->used += size;
+    return p;
+}
+
+// ---- Release the reserve ----
+void arena_free(Arena* arena) {
+    free(arena->block);
+    memset(arena, 0, sizeof(*arena));
+}
+
+// ---- Row of the export timeline ----
+typedef struct {
+    SongPos pos;        // Pattern row to render
+    Uint32 start;       // First output frame
+    Uint32 frames;      // Row length in frames
+    Uint32 phase[MAX_CHANNELS]; // Oscillator phase at the row start
+    Uint64 legato_in;   // Bit per channel: tone carried on from the last row
+    Uint64 legato_out;  // Bit per channel: tone carried on into the next row
+} RenderRow;
+
+// ---- Rows an export plays, in three spans ----
+// A looped song plays the rows before the loop, the loop body 'loops'
+// times, then the rows after it; any other song plays once.
+typedef struct {
+    int intro_rows;     // Rows before the loop body
+    int loop_start;     // First row of the loop body
+    int loop_rows;      // Rows in the loop body (0 = no loop)
+    int loops;          // Times the loop body plays
+    int outro_start;    // First row after the loop body
+    int outro_rows;     // Rows after the loop body
+    int total_rows;     // Timeline length in rows
+    Uint32 total_frames; // Timeline length in frames
+} RenderPlan;
+
+// ---- Walks the export timeline one row at a time ----
+typedef struct {
+    Song* song;
+    RenderPlan plan;
+    int current_row;    // Timeline row of the next step
+    RowClock clock;
+    Uint32 start;       // Start frame of the next row
+    Uint32 phase[MAX_CHANNELS]; // Oscillator phase, as in the engine
+    RenderRow ahead;    // Following row, read early for its legato
+    int has_ahead;
+    Uint64 last_tones;  // Channels with a tone on the row before 'ahead'
+} RenderCursor;
+
+// ---- Everything one channel's sound on one timeline row depends on ----
+// Fields that do not affect a cell's voice are left 0, so equal cells
+// share a key wherever they play, in this song or any other.
+typedef struct {
+    Uint32 frames;      // Row length, so the key changes with the tempo
+    Sint32 wave;        // Built-in waveform, or -1 for a sample
+    Uint64 sample;      // Hash of the sample's PCM (0 for tones)
+    float pitch_ratio;  // Sample read rate (0 for tones)
+    Uint32 phase;       // Tone phase at the row start (0 for samples)
+    Uint8 note;         // Tone note (0 for samples)
+    Uint8 legato;       // Bit 0: carried on from the last row, bit 1: into the next
+    Uint16 interp;      // Interpolation of samples (0 for tones)
+    Envelope env;
+    Uint32 reserved;    // Keeps the key free of padding, for memcmp()
+} RenderChunkKey;
+
+// ---- One channel's rendered row: mono and dry, before its gains and effects ----
+typedef struct {
+    RenderChunkKey key;
+    Uint32 hash;
+    float* data;        // The row, then as much of its release as still sounds
+    Uint32 len;         // Frames in 'data'
+    Uint32 last_use;    // Batch that last needed it, for eviction
+    int used;           // In a bucket (0 = on the free list)
+    int next;           // 1 + next chunk in its bucket or on the free list (0 = none)
+} RenderChunk;
+
+// ---- Rendered rows kept across exports (main thread) ----
+// Chunks are found by key, so an edit only misses the rows it changed:
+// a new cell, tempo or sample gives a new key and everything else is
+// mixed again from the cache. Chunks no export has used for longest go
+// first once the cache is over RENDER_CACHE_MB.
+typedef struct {
+    RenderChunk* chunks;
+    int count;
+    int capacity;
+    int buckets[RENDER_CACHE_BUCKETS]; // 1 + first chunk of each hash chain (0 = empty)
+    int free_list;      // 1 + first evicted chunk slot (0 = none)
+    size_t bytes;       // PCM held by the chunks
+    Uint32 batch;       // Export batches looked up so far
+    Uint64 hits;
+    Uint64 misses;
+    Uint64* ages;       // Eviction scratch, 'capacity' long
+} RenderCache;
+
+RenderCache render_cache;
+Arena render_arena;     // Scratch of save_song_to_wav(), kept for the next export
+
+// A block mix is 'frames' long plus a tail of 'tail' frames where its
+// notes ring out into whatever follows. It holds the stereo mix of the
+// channels without effects, then one dry mono lane for each channel
+// with effects; the effects run later, in timeline order. A stem export
+// gives every channel a lane, and mixes the stereo part just the same,
+// so its master comes out identical to a plain export.
+
+// ---- Rendered span of consecutive rows of one pattern ----
+typedef struct {
+    int first;          // First row in the batch row list
+    int count;          // Number of rows
+    Uint32 frames;      // Total frames
+    float* bus;         // Mix, EXPORT_BLOCK_FRAMES plus the tail per lane
+    Sint16* pcm;        // Stereo output, EXPORT_BLOCK_FRAMES capacity
+} RenderBlock;
+
+// ---- Chunk a worker renders: a cell played on its own ----
+typedef struct {
+    int chunk;          // Chunk in the render cache
+    int row;            // Row in the batch row list
+    int channel;
+    int failed;         // Out of memory for the chunk (set by the worker)
+} RenderMiss;
+
+// ---- Shared state of one batch of export blocks ----
+typedef struct {
+    Song* song;
+    RenderRow* rows;
+    RenderBlock* blocks;
+    int num_blocks;
+    int dither;         // Apply TPDF dither to the output
+    int interp;         // Interpolation of sample voices
+    Uint32 tail;        // Longest release of any instrument, in frames
+    float* carry;       // Tails still ringing into the next block (main thread)
+    int lanes;          // Channels with effects, rendered dry into lanes of their own
+    int stems;          // Every channel has a lane, and a stem of its own
+    Sint16* stem_pcm;   // Stereo stems of a block, EXPORT_BLOCK_FRAMES per channel, then the reverb
+    int lane_of[MAX_CHANNELS]; // Lane of each channel (-1 = mixed straight into the bus)
+    int lane_channel[MAX_CHANNELS]; // Channel of each lane
+    FxState* fx;        // Effect state of each lane (main thread)
+    Reverb* reverb;     // Shared reverb, NULL if nothing sends to it
+    RenderCache* cache;
+    int* row_chunks;    // Chunk of each batch row and channel (-1 = silent)
+    RenderMiss* misses; // Chunks to render before the blocks are mixed
+    int num_misses;
+    int mixing;         // Workers mix blocks (1) or render misses (0)
+    float* scratch;     // Workers' chunk buffers, 'scratch_size' floats each
+    Uint32 scratch_size; // Longest row plus the tail
+    pthread_mutex_t lock;
+    int next_item;      // First miss or block not yet claimed (lock)
+    int next_worker;    // Scratch buffer of the next worker to start (lock)
+} RenderJob;
+
+// ---- Fill a 16-bit stereo WAV header for 'frames' frames ----
+void wav_header_init(WavHeader* header, Uint32 frames) {
+    memcpy(header->riff, "RIFF", 4);
+    memcpy(header->wave, "WAVE", 4);
+    memcpy(header->fmt, "fmt ", 4);
+    memcpy(header->data, "data", 4);
+    
+    header->fmt_size = 16;
+    header->audio_format = 1; // PCM
+    header->num_channels = 2; // Stereo
+    header->sample_rate = SAMPLE_RATE;
+    header->bits_per_sample = 16;
+    header->block_align = header->num_channels * header->bits_per_sample / 8;
+    header->byte_rate = header->sample_rate * header->block_align;
+    
+    header->data_size = frames * header->block_align;
+    header->file_size = header->data_size + sizeof(WavHeader) - 8;
+}
+
+// ---- Plan the export timeline of a song ----
+void render_plan_init(RenderPlan* plan, const Song* song, int loops) {
+    int length = song_length(song);
+    
+    memset(plan, 0, sizeof(*plan));
+    plan->intro_rows = length;
+    if (song->loop_enabled && song->loop_end > song->loop_start) {
+        plan->intro_rows = song->loop_start;
+        plan->loop_start = song->loop_start;
+        plan->loop_rows = song->loop_end - song->loop_start + 1;
+        plan->loops = loops > 0 ? loops : EXPORT_LOOPS;
+        plan->outro_start = song->loop_end + 1;
+        plan->outro_rows = length - plan->outro_start;
+    }
+    plan->total_rows = plan->intro_rows + plan->loop_rows * plan->loops + plan->outro_rows;
+    
+    // Same exact row clock as playback, so long exports don't drift
+    plan->total_frames = (Uint32)row_clock_total(song->bpm, plan->total_rows);
+}
+
+// ---- Song row played at a timeline row of the plan ----
+int render_plan_row(const RenderPlan* plan, int row) {
+    if (row < plan->intro_rows) return row;
+    row -= plan->intro_rows;
+    if (row < plan->loop_rows * plan->loops) return plan->loop_start + row % plan->loop_rows;
+    return plan->outro_start + row - plan->loop_rows * plan->loops;
+}
+
+// ---- Step the export timeline by a row; returns 0 at the end ----
+int render_cursor_step(RenderCursor* cur, RenderRow* out) {
+    Song* song = cur->song;
+    
+    if (cur->current_row >= cur->plan.total_rows) return 0;
+    
+    song_pos_at(song, render_plan_row(&cur->plan, cur->current_row), &out->pos);
+    out->start = cur->start;
+    out->frames = row_clock_next(&cur->clock);
+    cur->start += out->frames;
+    
+    // Tone phase depends on every earlier row, so it is worked out here
+    Cell* cells = pattern_row(song, out->pos.pattern, out->pos.row);
+    memcpy(out->phase, cur->phase, sizeof(cur->phase));
+    for (int ch = 0; ch < song->num_channels; ch++) {
+        cur->phase[ch] += tone_phase_advance(song, &cells[ch], out->frames);
+    }
+    cur->current_row++;
+    return 1;
+}
+
+// ---- Start of the export timeline ----
+void render_cursor_init(RenderCursor* cur, Song* song, int loops) {
+    cur->song = song;
+    render_plan_init(&cur->plan, song, loops);
+    cur->current_row = 0;
+    row_clock_init(&cur->clock, song->bpm);
+    cur->start = 0;
+    memset(cur->phase, 0, sizeof(cur->phase));
+    cur->last_tones = 0;
+    cur->has_ahead = render_cursor_step(cur, &cur->ahead);
+}
+
+// ---- Channels of a row that play tones ----
+Uint64 render_row_tones(const Song* song, const RenderRow* rr) {
+    Cell* cells = pattern_row(song, rr->pos.pattern, rr->pos.row);
+    Uint64 tones = 0;
+    
+    for (int ch = 0; ch < song->num_channels; ch++) {
+        if (tone_phase_advance(song, &cells[ch], 1) != 0) tones |= 1ULL << ch;
+    }
+    return tones;
+}
+
+// ---- Next row of the export timeline; returns 0 at the end ----
+// Reads one row ahead, since a tone followed by another on the same
+// channel is held across the row boundary instead of released.
+int render_cursor_next(RenderCursor* cur, RenderRow* out) {
+    if (!cur->has_ahead) return 0;
+    
+    *out = cur->ahead;
+    cur->has_ahead = render_cursor_step(cur, &cur->ahead);
+    
+    Uint64 tones = render_row_tones(cur->song, out);
+    out->legato_in = cur->last_tones & tones;
+    out->legato_out = cur->has_ahead ? tones & render_row_tones(cur->song, &cur->ahead) : 0;
+    cur->last_tones = tones;
+    return 1;
+}
+
+// ---- Render cache key of a channel on a timeline row; 0 if it is silent ----
+int render_chunk_key(const Song* song, const RenderRow* rr, int channel, int interp, RenderChunkKey* key) {
+    const Cell* c = &pattern_row(song, rr->pos.pattern, rr->pos.row)[channel];
+    if (c->note <= 0) return 0;
+    
+    const Instrument* ins = &song->instruments[c->instrument];
+    memset(key, 0, sizeof(*key));
+    key->frames = rr->frames;
+    key->wave = ins->wave;
+    key->env = ins->env;
+    key->legato = (rr->legato_in >> channel & 1) | (rr->legato_out >> channel & 1) << 1;
+    
+    if (ins->wave < 0) {
+        if (!ins->smp || !ins->smp->data) return 0;
+        key->sample = ins->smp->hash;
+        key->pitch_ratio = c->pitch_ratio;
+        key->interp = (Uint16)interp;
+    } else {
+        key->note = c->note;
+        key->phase = rr->phase[channel];
     }
+    return 1;
+}
+
+// ---- FNV-1a hash of a chunk key ----
+Uint32 render_chunk_hash(const RenderChunkKey* key) {
+    const Uint8* p = (const Uint8*)key;
+    Uint32 h = 2166136261u;
     
-    Mix_AllocateChannels(8);
+    for (size_t i = 0; i < sizeof(*key); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+// ---- Find a chunk, or add an empty one for a worker to render ----
+// Returns -1 if out of memory.
+int render_cache_lookup(RenderCache* cache, const RenderChunkKey* key, int* hit) {
+    Uint32 hash = render_chunk_hash(key);
+    int* bucket = &cache->buckets[hash & (RENDER_CACHE_BUCKETS - 1)];
     
-    // Initialize thread data
-    for (int i = 0; i < MAX_CHANNELS; i++) {
-        tone_threads[i].active = 0;
-        tone_threads[i].freq = 0;
-        sample_threads[i].active = 0;
-        sample_threads[i].filename[0] = '\0';
+    for (int i = *bucket; i != 0; i = cache->chunks[i - 1].next) {
+        RenderChunk* chunk = &cache->chunks[i - 1];
+        if (chunk->hash == hash && memcmp(&chunk->key, key, sizeof(*key)) == 0) {
+            chunk->last_use = cache->batch;
+            cache->hits++;
+            *hit = 1;
+            return i - 1;
+        }
     }
     
-    play_row(song, row);
+    cache->misses++;
+    *hit = 0;
     
-    // Stop all playback
-    for (int i = 0; i < MAX_CHANNELS; i++) {
-        pthread_mutex_lock(&audio_mutex);
-        tone_threads[i].active = 0;
-        sample_threads[i].active = 0;
-        pthread_mutex_unlock(&audio_mutex);
+    int index;
+    if (cache->free_list != 0) {
+        index = cache->free_list - 1;
+        cache->free_list = cache->chunks[index].next;
+    } else {
+        if (cache->count == cache->capacity) {
+            int capacity = cache->capacity ? cache->capacity * 2 : 1024;
+            RenderChunk* grown = realloc(cache->chunks, capacity * sizeof(RenderChunk));
+            if (!grown) return -1;
+            cache->chunks = grown;
+            Uint64* ages = realloc(cache->ages, capacity * sizeof(Uint64));
+            if (!ages) return -1;
+            cache->ages = ages;
+            cache->capacity = capacity;
+        }
+        index = cache->count++;
     }
     
-    SDL_Delay(100);
+    RenderChunk* chunk = &cache->chunks[index];
+    chunk->key = *key;
+    chunk->hash = hash;
+    chunk->data = NULL;
+    chunk->len = 0;
+    chunk->last_use = cache->batch;
+    chunk->used = 1;
+    chunk->next = *bucket;
+    *bucket = index + 1;
+    return index;
+}
+
+// ---- Unlink a chunk from its bucket and free its PCM ----
+void render_cache_evict(RenderCache* cache, int index) {
+    RenderChunk* chunk = &cache->chunks[index];
+    int* link = &cache->buckets[chunk->hash & (RENDER_CACHE_BUCKETS - 1)];
     
-    Mix_CloseAudio();
-    SDL_Quit();
+    while (*link != index + 1) link = &cache->chunks[*link - 1].next;
+    *link = chunk->next;
+    
+    cache->bytes -= (size_t)chunk->len * sizeof(float);
+    free(chunk->data);
+    chunk->data = NULL;
+    chunk->len = 0;
+    chunk->used = 0;
+    chunk->next = cache->free_list;
+    cache->free_list = index + 1;
 }
 
-// ---- Get character without Enter ----
-int getch() {
-    struct termios oldt, newt;
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-    int ch = getchar();
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-    return ch;
+// ---- Order of eviction candidates packed as last use << 32 | index ----
+int render_cache_age_cmp(const void* a, const void* b) {
+    Uint64 x = *(const Uint64*)a, y = *(const Uint64*)b;
+    return x < y ? -1 : x > y;
 }
 
-// ---- Generate sine wave for a note ----
-void generate_sine_wave(Sint16* buffer, Uint32 samples, double freq, double volume) {
-    for (Uint32 i = 0; i < samples; i++) {
-        buffer[i] = (Sint16)(32767 * volume * sin(2.0 * M_PI * freq * i / SAMPLE_RATE));
+// ---- Evict the least recently used chunks until at most 'limit' bytes remain ----
+// Chunks of the current batch are kept whatever their size.
+void render_cache_trim(RenderCache* cache, size_t limit) {
+    if (cache->bytes <= limit) return;
+    
+    Uint64* ages = cache->ages;
+    int n = 0;
+    for (int i = 0; i < cache->count; i++) {
+        RenderChunk* chunk = &cache->chunks[i];
+        if (chunk->used && chunk->last_use != cache->batch) {
+            ages[n++] = (Uint64)chunk->last_use << 32 | (Uint32)i;
+        }
+    }
+    
+    qsort(ages, n, sizeof(Uint64), render_cache_age_cmp);
+    for (int i = 0; i < n && cache->bytes > limit; i++) {
+        render_cache_evict(cache, (int)(Uint32)ages[i]);
     }
 }
 
+// ---- Free every chunk ----
+void render_cache_free(RenderCache* cache) {
+    for (int i = 0; i < cache->count; i++) free(cache->chunks[i].data);
+    free(cache->chunks);
+    free(cache->ages);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// ---- Longest release of any instrument: how far a row can ring past its end ----
+Uint32 song_release_frames(const Song* song) {
+    Uint32 tail = 0;
+    
+    for (int i = 0; i < song->num_instruments; i++) {
+        if (song->instruments[i].env.release > tail) tail = song->instruments[i].env.release;
+    }
+    return tail;
+}
+
+// ---- Render a chunk: one channel's cell on its own, to the end of its release ----
+// Same voice as playback, held for the row; the chunk stops where it
+// falls silent. It is rendered into the worker's scratch, so the cache
+// only allocates what it keeps. Returns 0 if out of memory.
+int render_chunk(const RenderJob* job, const RenderMiss* miss, float* scratch) {
+    const Song* song = job->song;
+    const RenderRow* rr = &job->rows[miss->row];
+    RenderChunk* chunk = &job->cache->chunks[miss->chunk];
+    const Cell* c = &pattern_row(song, rr->pos.pattern, rr->pos.row)[miss->channel];
+    Uint32 limit = rr->frames + job->tail;
+    Uint32 len = 0;
+    Voice v;
+    
+    chunk->data = NULL;
+    chunk->len = 0;
+    if (!voice_start(&v, c, &song->instruments[c->instrument], rr->frames)) return 1;
+    
+    v.phase = rr->phase[miss->channel];
+    if (job->interp == INTERP_SINC) voice_use_sinc(&v);
+    if (rr->legato_in >> miss->channel & 1) voice_legato(&v);
+    v.legato = rr->legato_out >> miss->channel & 1;
+    
+    while (v.active && len < limit) {
+        Uint32 n = limit - len < VOICE_BLOCK ? limit - len : VOICE_BLOCK;
+        len += voice_render(&v, scratch + len, n);
+    }
+    if (len == 0) return 1;
+    
+    chunk->data = malloc((size_t)len * sizeof(float));
+    if (!chunk->data) return 0;
+    memcpy(chunk->data, scratch, (size_t)len * sizeof(float));
+    chunk->len = len;
+    return 1;
+}
+
+// ---- Mix one timeline row of every channel from its chunks ----
+// 'bus' is stereo float and lane l starts at lanes + l * lane_size; both
+// have room for the row plus the job's tail, where its notes ring out.
+void render_row(const RenderJob* job, int row, float* bus, float* lanes, size_t lane_size) {
+    const Song* song = job->song;
+    const int* chunks = &job->row_chunks[(size_t)row * song->num_channels];
+    
+    for (int ch = 0; ch < song->num_channels; ch++) {
+        if (chunks[ch] < 0) continue;
+        const RenderChunk* chunk = &job->cache->chunks[chunks[ch]];
+        if (chunk->len == 0) continue;
+        
+        int lane = job->lane_of[ch];
+        if (lane >= 0) {
+            float* out = lanes + lane * lane_size;
+            for (Uint32 i = 0; i < chunk->len; i++) out[i] += chunk->data[i];
+        }
+        if (lane < 0 || (job->stems && !channel_fx_active(&song->fx[ch]))) {
+            float gain_l, gain_r;
+            channel_gains(&song->fx[ch], &gain_l, &gain_r);
+            mix_kernels.mix_pan(bus, chunk->data, chunk->len, gain_l, gain_r);
+        }
+    }
+}
+
+// ---- Move a tail carry on by 'frames' and add a block's own tail to it ----
+// 'width' is 2 for the stereo bus and 1 for an effect lane.
+void render_carry(float* carry, const float* tail_in, Uint32 frames, Uint32 tail, int width) {
+    Uint32 keep = frames < tail ? tail - frames : 0;
+    memmove(carry, carry + (tail - keep) * width, keep * width * sizeof(float));
+    memset(carry + keep * width, 0, (tail - keep) * width * sizeof(float));
+    for (Uint32 i = 0; tail_in && i < tail * width; i++) {
+        carry[i] += tail_in[i];
+    }
+}
+
+// ---- Quantize a piece of stem 'index' to the job's stem output ----
+// 'frame' is the timeline position, 'offset' the position in the block.
+void render_stem_s16(const RenderJob* job, int index, const float* stem, Uint32 frames, Uint32 frame, Uint32 offset) {
+    Sint16* out = job->stem_pcm + ((size_t)index * EXPORT_BLOCK_FRAMES + offset) * 2;
+    bus_to_s16(out, stem, frames, job->dither, ((Uint64)(index + 1) << 32) + frame);
+}
+
+// ---- Output stage of a block, in timeline order (main thread) ----
+// Adds the tails of earlier blocks, runs the effect lanes through their
+// chains, and carries this block's own tail on. A NULL 'bus' is silence
+// (effects still ring out). Dither is keyed to the output position, and
+// to the stem, so stems do not share their noise.
+void render_output(RenderJob* job, const float* bus, Uint32 frames, Uint32 start, Sint16* pcm) {
+    float mixed[VOICE_BLOCK * 2];
+    float block[VOICE_BLOCK];
+    float send[VOICE_BLOCK];
+    float wet[VOICE_BLOCK * 2];
+    float stem[VOICE_BLOCK * 2];
+    Uint32 tail = job->tail;
+    size_t size = (size_t)frames + tail;    // Length of each lane of 'bus'
+    float* carry = job->carry;
+    float* lane_carry = carry + tail * 2;
+    
+    for (Uint32 done = 0; done < frames; ) {
+        Uint32 n = frames - done < VOICE_BLOCK ? frames - done : VOICE_BLOCK;
+        for (Uint32 i = 0; i < n * 2; i++) {
+            Uint32 k = done * 2 + i;
+            mixed[i] = (bus ? bus[k] : 0.0f) + (k < tail * 2 ? carry[k] : 0.0f);
+        }
+        
+        if (job->reverb) memset(send, 0, n * sizeof(float));
+        for (int l = 0; l < job->lanes; l++) {
+            const float* lane = bus ? bus + (2 + l) * size : NULL;
+            for (Uint32 i = 0; i < n; i++) {
+                Uint32 k = done + i;
+                block[i] = (lane ? lane[k] : 0.0f) + (k < tail ? lane_carry[l * tail + k] : 0.0f);
+            }
+            int ch = job->lane_channel[l];
+            const ChannelFx* fx = &job->song->fx[ch];
+            if (job->stems) memset(stem, 0, n * 2 * sizeof(float));
+            if (channel_fx_active(fx)) {
+                fx_channel(fx, &job->fx[l], block, mixed, job->stems ? stem : NULL, send, n);
+            } else if (job->stems) {
+                // Already in the bus; only its stem is mixed here
+                float gain_l, gain_r;
+                channel_gains(fx, &gain_l, &gain_r);
+                mix_kernels.mix_pan(stem, block, n, gain_l, gain_r);
+            }
+            if (job->stems) render_stem_s16(job, ch, stem, n, start + done, done);
+        }
+        
+        // The reverb is summed into the mix as one piece, the same with or
+        // without stems
+        if (job->reverb) {
+            memset(wet, 0, n * 2 * sizeof(float));
+            reverb_process(job->reverb, send, wet, n);
+            for (Uint32 i = 0; i < n * 2; i++) mixed[i] += wet[i];
+            if (job->stems) render_stem_s16(job, job->song->num_channels, wet, n, start + done, done);
+        }
+        
+        bus_to_s16(pcm + done * 2, mixed, n, job->dither, (Uint64)start + done);
+        done += n;
+    }
+    
+    // Tails that outlast this block move up, then this block's tail is added
+    render_carry(carry, bus ? bus + frames * 2 : NULL, frames, tail, 2);
+    for (int l = 0; l < job->lanes; l++) {
+        render_carry(lane_carry + l * tail, bus ? bus + (2 + l) * size + frames : NULL, frames, tail, 1);
+    }
+}
+
+// ---- Export worker: render missing chunks, or mix whole blocks ----
+void* render_worker(void* arg) {
+    RenderJob* job = (RenderJob*)arg;
+    int items = job->mixing ? job->num_blocks : job->num_misses;
+    
+    pthread_mutex_lock(&job->lock);
+    float* scratch = job->scratch + (size_t)job->next_worker++ * job->scratch_size;
+    pthread_mutex_unlock(&job->lock);
+    
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next_item++;
+        pthread_mutex_unlock(&job->lock);
+        
+        if (i >= items) break;
+        if (!job->mixing) {
+            job->misses[i].failed = !render_chunk(job, &job->misses[i], scratch);
+            continue;
+        }
+        
+        // A block mixes its own notes to the end of their release, in a
+        // tail past the block, so no other worker writes to its buffer.
+        // Tails are summed across blocks by the output stage.
+        RenderBlock* block = &job->blocks[i];
+        Uint32 base = job->rows[block->first].start;
+        size_t size = (size_t)block->frames + job->tail;
+        
+        memset(block->bus, 0, size * (2 + job->lanes) * sizeof(float));
+        for (int r = block->first; r < block->first + block->count; r++) {
+            Uint32 offset = job->rows[r].start - base;
+            render_row(job, r, block->bus + offset * 2, block->bus + 2 * size + offset, size);
+        }
+    }
+    
+    return NULL;
+}
+
+// ---- Run one stage of a batch on 'threads' workers ----
+void render_batch(RenderJob* job, int threads) {
+    int items = job->mixing ? job->num_blocks : job->num_misses;
+    job->next_item = 0;
+    job->next_worker = 0;
+    if (threads > items) threads = items;
+    
+    pthread_t workers[threads > 1 ? threads : 1];
+    int started = 0;
+    if (threads > 1) {
+        for (; started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, render_worker, job) != 0) break;
+        }
+    }
+    
+    // The calling thread helps, and covers for workers that failed to start
+    render_worker(job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+// ---- Number of export threads for the given options ----
+int render_thread_count(const RenderOptions* opts) {
+    if (opts && opts->threads > 0) return opts->threads;
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// ---- File of stem 'index' of an export: "song_ch03.wav" beside "song.wav" ----
+// The index after the last channel is the reverb, "song_reverb.wav".
+void render_stem_path(char* out, size_t size, const char* filename, int index, int num_channels) {
+    const char* ext = strrchr(filename, '.');
+    int base = ext && strcmp(ext, ".wav") == 0 ? (int)(ext - filename) : (int)strlen(filename);
+    
+    if (index < num_channels) snprintf(out, size, "%.*s_ch%02d.wav", base, filename, index);
+    else snprintf(out, size, "%.*s_reverb.wav", base, filename);
+}
+
 // ---- Save song to WAV file ----
-int save_song_to_wav(Song* song, const char* filename) {
-    // Calculate total duration in samples
-    int note_duration = get_note_duration_ms(song);
-    int total_rows = song->num_rows;
+// Rendering is streamed: a bounded batch of blocks is rendered, written
+// out, and reused, so memory use does not grow with the song length.
+// With stems, the same pass writes every channel to a file of its own
+// beside the master, plus the reverb when anything sends to it.
+//
+// A segment writes only the frames of its rows, exactly as a whole export
+// would, and ends in a WavSegment chunk saying where they go. The rows
+// before it are cut into the same blocks, so every sum is taken in the
+// same order, but only what can still reach the segment is rendered: the
+// rows within a release of its start, and channels with effects from the
+// top, since their filter, delay and reverb never quite forget.
+int save_song_to_wav(Song* song, const char* filename, const RenderOptions* opts) {
+    RenderCursor cursor;
+    render_cursor_init(&cursor, song, opts ? opts->loops : 0);
+    const RenderPlan* plan = &cursor.plan;
     
-    if (song->loop_enabled && song->loop_end > song->loop_start) {
-        // For looped songs, render a few loops
-        total_rows = song->loop_end - song->loop_start + 1;
-        total_rows *= 4; // Render 4 loops
+    int segment = opts && (opts->segment_start > 0 || opts->segment_end > 0);
+    int segment_start = segment ? opts->segment_start : 0;
+    int segment_end = segment && opts->segment_end > 0 ? opts->segment_end : plan->total_rows;
+    if (segment_start < 0 || segment_start >= segment_end || segment_end > plan->total_rows) {
+        printf("Error: Segment %d:%d is outside the %d rows of the song\n",
+               segment_start, segment_end, plan->total_rows);
+        return 0;
+    }
+    
+    int threads = render_thread_count(opts);
+    int batch_blocks = threads * 2;
+    Uint32 tail = song_release_frames(song);
+    Uint32 first_frame = (Uint32)row_clock_total(song->bpm, segment_start);
+    Uint32 end_frame = (Uint32)row_clock_total(song->bpm, segment_end);
+    Uint32 preroll = first_frame > tail ? first_frame - tail : 0; // Rows ending here cannot reach the segment
+    
+    RenderJob job;
+    job.song = song;
+    job.dither = opts ? opts->dither : 0;
+    job.interp = opts ? opts->interp : INTERP_LINEAR;
+    job.tail = tail;
+    
+    // Channels with effects get a lane each; the rest skip the chain
+    // unless they need a lane for their stem
+    int sends = 0;
+    job.stems = opts ? opts->stems : 0;
+    job.lanes = 0;
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        job.lane_of[ch] = -1;
+        if (ch >= song->num_channels) continue;
+        int active = channel_fx_active(&song->fx[ch]);
+        if (active && song->fx[ch].send > 0.0f) sends++;
+        if (!active && !job.stems) continue;
+        job.lane_channel[job.lanes] = ch;
+        job.lane_of[ch] = job.lanes++;
     }
+    int planes = 2 + job.lanes;
+    int num_stems = job.stems ? song->num_channels + (sends > 0) : 0;
     
-    Uint32 total_samples = total_rows * note_duration * SAMPLE_RATE / 1000;
+    // Every buffer of the export comes out of one arena, and a worker
+    // renders each chunk in a scratch buffer of its own: one more than
+    // the threads, since the calling thread works too
+    size_t batch_rows = (size_t)batch_blocks * EXPORT_BLOCK_ROWS;
+    size_t cells = batch_rows * song->num_channels;
+    size_t pcm_size = EXPORT_BLOCK_FRAMES * 2 * sizeof(Sint16);
+    size_t bus_size = (size_t)(EXPORT_BLOCK_FRAMES + tail) * planes * sizeof(float);
+    size_t carry_size = ((size_t)tail * planes + 1) * sizeof(float);
+    job.scratch_size = (Uint32)row_clock_total(song->bpm, 1) + 1 + tail;
+    size_t scratch_size = (size_t)(threads + 1) * job.scratch_size * sizeof(float);
+    size_t stems_size = job.stems ? (song->num_channels + 1) * pcm_size : 0;
     
-    // Allocate audio buffer (stereo)
-    Sint16* audio_buffer = calloc(total_samples * 2, sizeof(Sint16));
-    if (!audio_buffer) {
+    size_t need = arena_round(batch_blocks * sizeof(RenderBlock)) + arena_round(batch_rows * sizeof(RenderRow)) +
+                  arena_round(carry_size) + arena_round((job.lanes + 1) * sizeof(FxState)) +
+                  arena_round(sizeof(Reverb)) + arena_round(cells * sizeof(int)) +
+                  arena_round(cells * sizeof(RenderMiss)) + arena_round(scratch_size) + arena_round(stems_size) +
+                  batch_blocks * (arena_round(pcm_size) + arena_round(bus_size));
+    Arena* arena = &render_arena;
+    if (!arena_reserve(arena, need)) {
         printf("Error: Could not allocate audio buffer\n");
         return 0;
     }
     
-    printf("Rendering %d rows to WAV...\n", total_rows);
+    RenderBlock* blocks = arena_alloc(arena, batch_blocks * sizeof(RenderBlock));
+    RenderRow* rows = arena_alloc(arena, batch_rows * sizeof(RenderRow));
+    float* carry = arena_alloc(arena, carry_size);
+    job.fx = arena_alloc(arena, (job.lanes + 1) * sizeof(FxState));
+    job.reverb = arena_alloc(arena, sizeof(Reverb));
+    job.row_chunks = arena_alloc(arena, cells * sizeof(int));
+    job.misses = arena_alloc(arena, cells * sizeof(RenderMiss));
+    job.scratch = arena_alloc(arena, scratch_size);
+    job.stem_pcm = arena_alloc(arena, stems_size);
+    for (int b = 0; b < batch_blocks; b++) {
+        blocks[b].pcm = arena_alloc(arena, pcm_size);
+        blocks[b].bus = arena_alloc(arena, bus_size);
+    }
+    memset(carry, 0, carry_size);
+    memset(job.fx, 0, (job.lanes + 1) * sizeof(FxState));
+    if (sends > 0) memset(job.reverb, 0, sizeof(Reverb));
+    else job.reverb = NULL;
     
-    // Initialize SDL_mixer for sample loading
-    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
-        printf("SDL_Init error: %s\n", SDL_GetError());
-        free(audio_buffer);
+    // Create WAV file
+    FILE* wav_file = fopen(filename, "wb");
+    if (!wav_file) {
+        printf("Error: Could not create WAV file\n");
         return 0;
     }
     
-    if (Mix_OpenAudio(SAMPLE_RATE, MIX_DEFAULT_FORMAT, 2, 2048) < 0) {
-        printf("Mix_OpenAudio error: %s\n", Mix_GetError());
-        free(audio_buffer);
-        SDL_Quit();
-        return 0;
+    // Sizes are patched once everything has been written
+    WavHeader header;
+    wav_header_init(&header, 0);
+    fwrite(&header, sizeof(WavHeader), 1, wav_file);
+    
+    FILE* stem_files[MAX_CHANNELS + 1];
+    for (int s = 0; s < num_stems; s++) {
+        char path[512];
+        render_stem_path(path, sizeof(path), filename, s, song->num_channels);
+        stem_files[s] = fopen(path, "wb");
+        if (!stem_files[s]) {
+            printf("Error: Could not create WAV file %s\n", path);
+            while (s-- > 0) fclose(stem_files[s]);
+            fclose(wav_file);
+            return 0;
+        }
+        fwrite(&header, sizeof(WavHeader), 1, stem_files[s]);
+    }
+    
+    if (plan->loop_rows > 0) {
+        printf("Rendering %d intro rows, %d-row loop x%d, %d outro rows\n",
+               plan->intro_rows, plan->loop_rows, plan->loops, plan->outro_rows);
+    }
+    if (segment) {
+        printf("Rendering rows %d-%d of %d to WAV on %d thread(s)...\n",
+               segment_start, segment_end - 1, plan->total_rows, threads);
+    } else {
+        printf("Rendering %d rows to WAV on %d thread(s)...\n", plan->total_rows, threads);
     }
+    if (num_stems > 0) printf("Writing %d stems beside the master\n", num_stems);
     
-    Mix_AllocateChannels(8);
+    job.rows = rows;
+    job.blocks = blocks;
+    job.carry = carry;
+    job.cache = &render_cache;
+    pthread_mutex_init(&job.lock, NULL);
     
-    // Render each row
-    int current_row = 0;
-    int loops_done = 0;
+    RenderCache* cache = &render_cache;
+    Uint64 hits = cache->hits;
+    Uint64 misses = cache->misses;
     
-    while (current_row < total_rows) {
-        int actual_row = current_row % song->num_rows;
+    Uint32 written = 0;
+    int rows_done = 0;
+    int write_error = 0;
+    RenderRow pending;
+    int has_pending = render_cursor_next(&cursor, &pending) && pending.start < end_frame;
+    
+    while (has_pending && !write_error) {
+        // Cut the timeline into blocks of consecutive rows of one pattern
+        int num_rows = 0;
+        job.num_blocks = 0;
+        while (has_pending && job.num_blocks < batch_blocks) {
+            RenderBlock* block = &blocks[job.num_blocks++];
+            block->first = num_rows;
+            block->count = 0;
+            block->frames = 0;
+            
+            while (has_pending && block->count < EXPORT_BLOCK_ROWS &&
+                   block->frames + pending.frames <= EXPORT_BLOCK_FRAMES) {
+                if (block->count > 0) {
+                    RenderRow* last = &rows[num_rows - 1];
+                    if (pending.pos.pattern != last->pos.pattern || pending.pos.row != last->pos.row + 1) break;
+                }
+                rows[num_rows++] = pending;
+                block->count++;
+                block->frames += pending.frames;
+                has_pending = render_cursor_next(&cursor, &pending) && pending.start < end_frame;
+            }
+        }
         
-        if (song->loop_enabled && actual_row > song->loop_end) {
-            actual_row = song->loop_start;
-            loops_done++;
-            if (loops_done >= 4) break; // Only render 4 loops
+        // Find every channel's row in the cache; workers render the rest
+        // first, then mix the blocks from the cache
+        cache->batch++;
+        job.num_misses = 0;
+        for (int r = 0; r < num_rows; r++) {
+            int early = rows[r].start + rows[r].frames <= preroll;
+            for (int ch = 0; ch < song->num_channels; ch++) {
+                RenderChunkKey key;
+                int hit = 1;
+                int needed = !early || channel_fx_active(&song->fx[ch]);
+                int chunk = needed && render_chunk_key(song, &rows[r], ch, job.interp, &key) ?
+                            render_cache_lookup(cache, &key, &hit) : -1;
+                if (!hit && chunk >= 0) {
+                    RenderMiss miss = {chunk, r, ch, 0};
+                    job.misses[job.num_misses++] = miss;
+                }
+                if (!hit && chunk < 0) write_error = 2;
+                job.row_chunks[(size_t)r * song->num_channels + ch] = chunk;
+            }
         }
         
-        printf("Rendering row %d/%d (actual: %d)\r", current_row + 1, total_rows, actual_row);
-        fflush(stdout);
+        job.mixing = 0;
+        render_batch(&job, threads);
+        for (int i = 0; i < job.num_misses; i++) {
+            RenderChunk* chunk = &cache->chunks[job.misses[i].chunk];
+            cache->bytes += (size_t)chunk->len * sizeof(float);
+            if (job.misses[i].failed) {
+                // Out of memory: never leave an unrendered chunk to be found
+                render_cache_evict(cache, job.misses[i].chunk);
+                write_error = 2;
+            }
+        }
+        if (write_error) break;
         
-        // Calculate position in buffer
-        Uint32 start_sample = current_row * note_duration * SAMPLE_RATE / 1000;
-        Uint32 row_samples = note_duration * SAMPLE_RATE / 1000;
+        job.mixing = 1;
+        render_batch(&job, threads);
+        render_cache_trim(cache, (size_t)RENDER_CACHE_MB << 20);
         
-        // Process each channel
-        for (int ch = 0; ch < song->num_channels; ch++) {
-            Cell* c = &song->channels[ch].cells[actual_row];
+        // Write the blocks out in timeline order, as far as they overlap
+        // the segment. Before the prerolled rows there is only silence,
+        // unless effects are still running.
+        for (int b = 0; b < job.num_blocks; b++) {
+            RenderBlock* block = &blocks[b];
+            Uint32 start = rows[block->first].start;
+            Uint32 end = start + block->frames;
+            if (end <= preroll && job.lanes == 0) continue;
+            render_output(&job, block->bus, block->frames, start, block->pcm);
             
-            if (c->note > 0) {
-                Sint16* row_buffer = calloc(row_samples * 2, sizeof(Sint16));
-                if (!row_buffer) continue;
-                
-                if (strlen(c->sample) > 0) {
-                    // Load and process sample
-                    Mix_Chunk* sound = Mix_LoadWAV(c->sample);
-                    if (sound) {
-                        Uint32 original_len = sound->alen / sizeof(Sint16);
-                        Uint32 new_len;
-                        
-                        Sint16* sample_data = NULL;
-                        
-                        // Apply pitch shifting if needed
-                        if (fabs(c->pitch_ratio - 1.0) > 0.001) {
-                            sample_data = pitch_shift_sample((Sint16*)sound->abuf, 
-                                                           original_len, 
-                                                           c->pitch_ratio, 
-                                                           &new_len);
-                        } else {
-                            new_len = original_len;
-                            sample_data = malloc(new_len * sizeof(Sint16));
-                            if (sample_data) {
-                                memcpy(sample_data, sound->abuf, new_len * sizeof(Sint16));
-                            }
-                        }
-                        
-                        if (sample_data) {
-                            // Mix sample into row buffer
-                            Uint32 samples_to_mix = new_len < row_samples ? new_len : row_samples;
-                            
-                            // Convert mono to stereo and mix
-                            for (Uint32 i = 0; i < samples_to_mix; i++) {
-                                Sint16 sample = sample_data[i];
-                                // Apply panning: channel 0-3 left, 4-7 right
-                                float pan = ch < 4 ? 0.7f : 0.3f;
-                                
-                                if (ch < 4) {
-                                    // Left channel
-                                    int mixed = row_buffer[i*2] + (Sint16)(sample * pan);
-                                    if (mixed > 32767) mixed = 32767;
-                                    if (mixed < -32768) mixed = -32768;
-                                    row_buffer[i*2] = (Sint16)mixed;
-                                } else {
-                                    // Right channel
-                                    int mixed = row_buffer[i*2+1] + (Sint16)(sample * (1.0f - pan));
-                                    if (mixed > 32767) mixed = 32767;
-                                    if (mixed < -32768) mixed = -32768;
-                                    row_buffer[i*2+1] = (Sint16)mixed;
-                                }
-                            }
-                            
-                            free(sample_data);
-                        }
-                        
-                        Mix_FreeChunk(sound);
-                    }
-                } else {
-                    // Generate sine wave
-                    double freq = 440.0 * pow(2, (c->note - 69) / 12.0);
-                    
-                    // Convert mono to stereo with panning
-                    for (Uint32 i = 0; i < row_samples; i++) {
-                        Sint16 sample = (Sint16)(32767 * 0.3 * sin(2.0 * M_PI * freq * i / SAMPLE_RATE));
-                        
-                        // Apply panning: channel 0-3 left, 4-7 right
-                        float pan = ch < 4 ? 0.7f : 0.3f;
-                        
-                        if (ch < 4) {
-                            // Left channel
-                            int mixed = row_buffer[i*2] + (Sint16)(sample * pan);
-                            if (mixed > 32767) mixed = 32767;
-                            if (mixed < -32768) mixed = -32768;
-                            row_buffer[i*2] = (Sint16)mixed;
-                        } else {
-                            // Right channel
-                            int mixed = row_buffer[i*2+1] + (Sint16)(sample * (1.0f - pan));
-                            if (mixed > 32767) mixed = 32767;
-                            if (mixed < -32768) mixed = -32768;
-                            row_buffer[i*2+1] = (Sint16)mixed;
-                        }
-                    }
-                }
-                
-                // Mix row buffer into main buffer
-                for (Uint32 i = 0; i < row_samples; i++) {
-                    Uint32 dest_idx = (start_sample + i) * 2;
-                    
-                    // Left channel
-                    int mixed_left = audio_buffer[dest_idx] + row_buffer[i*2];
-                    if (mixed_left > 32767) mixed_left = 32767;
-                    if (mixed_left < -32768) mixed_left = -32768;
-                    audio_buffer[dest_idx] = (Sint16)mixed_left;
-                    
-                    // Right channel
-                    int mixed_right = audio_buffer[dest_idx+1] + row_buffer[i*2+1];
-                    if (mixed_right > 32767) mixed_right = 32767;
-                    if (mixed_right < -32768) mixed_right = -32768;
-                    audio_buffer[dest_idx+1] = (Sint16)mixed_right;
-                }
-                
-                free(row_buffer);
+            Uint32 from = start > first_frame ? start : first_frame;
+            Uint32 to = end < end_frame ? end : end_frame;
+            if (to <= from) continue;
+            Uint32 frames = to - from;
+            size_t offset = (size_t)(from - start) * 2;
+            if (fwrite(block->pcm + offset, 2 * sizeof(Sint16), frames, wav_file) != frames) {
+                write_error = 1;
+                break;
+            }
+            for (int s = 0; s < num_stems; s++) {
+                const Sint16* stem = job.stem_pcm + (size_t)s * EXPORT_BLOCK_FRAMES * 2 + offset;
+                if (fwrite(stem, 2 * sizeof(Sint16), frames, stem_files[s]) != frames) write_error = 1;
             }
+            if (write_error) break;
+            written += frames;
         }
         
-        current_row++;
+        rows_done += num_rows;
+        printf("Rendering row %d/%d\r", rows_done, segment_end);
+        fflush(stdout);
     }
     
+    pthread_mutex_destroy(&job.lock);
+    
     printf("\nDone rendering audio.\n");
+    hits = cache->hits - hits;
+    misses = cache->misses - misses;
+    printf("Render cache: %llu of %llu channel rows reused (%.1f MB held)\n",
+           (unsigned long long)hits, (unsigned long long)(hits + misses), cache->bytes / 1048576.0);
+    
+    // A segment says where it goes in a chunk after its data
+    WavSegment place = {{'c', 't', 's', 'g'}, sizeof(WavSegment) - 8, first_frame, written, plan->total_frames};
+    for (int s = -1; segment && !write_error && s < num_stems; s++) {
+        if (fwrite(&place, sizeof(WavSegment), 1, s < 0 ? wav_file : stem_files[s]) != 1) write_error = 1;
+    }
+    
+    // Patch the RIFF sizes now that the length is known
+    wav_header_init(&header, written);
+    if (segment) header.file_size += sizeof(WavSegment);
+    if (!write_error) {
+        if (fseek(wav_file, 0, SEEK_SET) != 0 ||
+            fwrite(&header, sizeof(WavHeader), 1, wav_file) != 1) {
+            write_error = 1;
+        }
+    }
+    
+    if (fclose(wav_file) != 0 && !write_error) write_error = 1;
+    for (int s = 0; s < num_stems; s++) {
+        if (!write_error && (fseek(stem_files[s], 0, SEEK_SET) != 0 ||
+                             fwrite(&header, sizeof(WavHeader), 1, stem_files[s]) != 1)) {
+            write_error = 1;
+        }
+        if (fclose(stem_files[s]) != 0 && !write_error) write_error = 1;
+    }
+    if (write_error) {
+        printf(write_error == 2 ? "Error: Could not allocate audio buffer\n"
+                                : "Error: Could not write WAV file\n");
+        return 0;
+    }
+    
+    printf("Song saved to %s (%d samples, %.2f seconds)\n", 
+           filename, written, (float)written / SAMPLE_RATE);
+    
+    return 1;
+}
+
+// ---- One segment file given to merge_wav_segments() ----
+typedef struct {
+    const char* path;
+    FILE* file;
+    WavSegment place;
+} MergeInput;
+
+int merge_input_cmp(const void* a, const void* b) {
+    Uint32 x = ((const MergeInput*)a)->place.first_frame;
+    Uint32 y = ((const MergeInput*)b)->place.first_frame;
+    return (x > y) - (x < y);
+}
+
+// ---- Open a segment render and read where it goes; 0 if it is not one ----
+int merge_input_open(MergeInput* in) {
+    WavHeader header, expect;
     
-    // Create WAV file
-    FILE* wav_file = fopen(filename, "wb");
-    if (!wav_file) {
-        printf("Error: Could not create WAV file\n");
-        free(audio_buffer);
-        Mix_CloseAudio();
-        SDL_Quit();
+    in->file = fopen(in->path, "rb");
+    if (!in->file) {
+        printf("Error: Could not open %s\n", in->path);
         return 0;
     }
     
-    // Prepare WAV header
-    WavHeader header;
-    memcpy(header.riff, "RIFF", 4);
-    memcpy(header.wave, "WAVE", 4);
-    memcpy(header.fmt, "fmt ", 4);
-    memcpy(header.data, "data", 4);
-    
-    header.fmt_size = 16;
-    header.audio_format = 1; // PCM
-    header.num_channels = 2; // Stereo
-    header.sample_rate = SAMPLE_RATE;
-    header.bits_per_sample = 16;
-    header.block_align = header.num_channels * header.bits_per_sample / 8;
-    header.byte_rate = header.sample_rate * header.block_align;
-    
-    header.data_size = total_samples * 2 * sizeof(Sint16);
-    header.file_size = header.data_size + sizeof(WavHeader) - 8;
+    // The header must be exactly what save_song_to_wav() writes
+    int ok = fread(&header, sizeof(WavHeader), 1, in->file) == 1;
+    if (ok) {
+        wav_header_init(&expect, header.data_size / 4);
+        expect.file_size += sizeof(WavSegment);
+        ok = memcmp(&header, &expect, sizeof(WavHeader)) == 0 &&
+             fseek(in->file, sizeof(WavHeader) + header.data_size, SEEK_SET) == 0 &&
+             fread(&in->place, sizeof(WavSegment), 1, in->file) == 1 &&
+             memcmp(in->place.id, "ctsg", 4) == 0 && in->place.frames == header.data_size / 4 &&
+             fseek(in->file, sizeof(WavHeader), SEEK_SET) == 0;
+    }
+    if (!ok) {
+        printf("Error: %s is not a CTracker segment render\n", in->path);
+        fclose(in->file);
+        in->file = NULL;
+    }
+    return ok;
+}
+
+// ---- Join segment renders into one WAV file ----
+// Segments may come in any order, but must cover the whole render with
+// no gaps or overlaps. Their PCM is copied as it is: the result is the
+// same file a whole export would have written.
+int merge_wav_segments(const char* filename, const char** paths, int count) {
+    MergeInput inputs[count];
+    int ok = 1;
     
-    // Write header
-    fwrite(&header, sizeof(WavHeader), 1, wav_file);
+    for (int i = 0; i < count; i++) {
+        inputs[i].path = paths[i];
+        inputs[i].file = NULL;
+    }
+    for (int i = 0; i < count && ok; i++) {
+        ok = merge_input_open(&inputs[i]);
+    }
+    
+    Uint32 total = 0;
+    if (ok) {
+        qsort(inputs, count, sizeof(MergeInput), merge_input_cmp);
+        total = inputs[0].place.total_frames;
+        Uint32 next = 0;
+        for (int i = 0; i < count && ok; i++) {
+            const WavSegment* place = &inputs[i].place;
+            if (place->total_frames != total) {
+                printf("Error: %s is a segment of another render\n", inputs[i].path);
+                ok = 0;
+            } else if (place->first_frame > next) {
+                printf("Error: Frames %u-%u are in no segment\n", next, place->first_frame - 1);
+                ok = 0;
+            } else if (place->first_frame < next) {
+                printf("Error: %s overlaps the segment before it\n", inputs[i].path);
+                ok = 0;
+            }
+            next = place->first_frame + place->frames;
+        }
+        if (ok && next != total) {
+            printf("Error: Frames %u-%u are in no segment\n", next, total - 1);
+            ok = 0;
+        }
+    }
     
-    // Write audio data
-    fwrite(audio_buffer, sizeof(Sint16), total_samples * 2, wav_file);
+    FILE* out = ok ? fopen(filename, "wb") : NULL;
+    if (ok && !out) {
+        printf("Error: Could not create WAV file\n");
+        ok = 0;
+    }
     
-    fclose(wav_file);
-    free(audio_buffer);
+    if (ok) {
+        WavHeader header;
+        wav_header_init(&header, total);
+        ok = fwrite(&header, sizeof(WavHeader), 1, out) == 1;
+        
+        Uint8 buffer[1 << 16];
+        for (int i = 0; i < count && ok; i++) {
+            size_t left = (size_t)inputs[i].place.frames * header.block_align;
+            while (left > 0 && ok) {
+                size_t n = left < sizeof(buffer) ? left : sizeof(buffer);
+                ok = fread(buffer, 1, n, inputs[i].file) == n && fwrite(buffer, 1, n, out) == n;
+                left -= n;
+            }
+        }
+        if (fclose(out) != 0) ok = 0;
+        if (!ok) printf("Error: Could not write WAV file\n");
+    }
     
-    Mix_CloseAudio();
-    SDL_Quit();
+    for (int i = 0; i < count; i++) {
+        if (inputs[i].file) fclose(inputs[i].file);
+    }
+    if (ok) {
+        printf("Merged %d segments into %s (%u samples, %.2f seconds)\n",
+               count, filename, total, (float)total / SAMPLE_RATE);
+    }
+    return ok;
+}
+
+// ---- Read the cells of one pattern, channel by channel ----
+// A malformed cell line loads as a rest instead of failing the whole song.
+int load_pattern_cells(FILE* file, Song* song, int pattern) {
+    char line[256];
+    int bad = 0;
     
-    printf("Song saved to %s (%d samples, %.2f seconds)\n", 
-           filename, total_samples, (float)total_samples / SAMPLE_RATE);
+    for (int ch = 0; ch < song->num_channels; ch++) {
+        for (int row = 0; row < song->patterns[pattern].num_rows; row++) {
+            Cell* c = song_cell(song, pattern, row, ch);
+            int note, original_note, used = 0;
+            char note_str[16];
+            
+            if (!fgets(line, sizeof(line), file)) {
+                printf("Error: file ends at channel %d, row %d\n", ch, row);
+                return 0;
+            }
+            if (!strchr(line, '\n')) {
+                int k;
+                while ((k = fgetc(file)) != EOF && k != '\n') {}
+            }
+            
+            if (sscanf(line, "%d %d %15s%n", &note, &original_note, note_str, &used) != 3) {
+                bad++;
+                continue;
+            }
+            
+            // The sample is the rest of the line and may be empty
+            char* sample = line + used;
+            if (*sample == ' ') sample++;
+            sample[strcspn(sample, "\r\n")] = 0;
+            if (strlen(sample) > 63) sample[63] = 0; // Longest path the sample bank keeps
+            
+            int ins = song_instrument(song, sample);
+            if (ins < 0) {
+                printf("Error: Could not add instrument %s\n", sample);
+                return 0;
+            }
+            
+            c->note = note > 0 && note < TOTAL_NOTES ? note : 0;
+            c->original_note = original_note > 0 && original_note < TOTAL_NOTES ? original_note : 0;
+            c->instrument = ins;
+            
+            if (c->note > 0 && c->original_note > 0) {
+                c->pitch_ratio = calculate_pitch_ratio(c->original_note, c->note);
+            } else {
+                c->pitch_ratio = 1.0f;
+            }
+        }
+    }
     
+    if (bad > 0) printf("Warning: %d malformed cells in pattern %d loaded as rests\n", bad, pattern);
     return 1;
 }
 
-// ---- Load song from file ----
-int load_song(Song* song, const char* filename) {
+// ---- Load song from a text file ----
+int load_song_text(Song* song, const char* filename) {
     FILE* file = fopen(filename, "r");
     if (!file) {
         printf("Error: Could not open file %s\n", filename);
@@ -960,71 +4483,128 @@ int load_song(Song* song, const char* filename) {
     
     // Read header
     char header[64];
+    int bpm, num_rows, num_channels, loop_enabled, loop_start, loop_end;
     fgets(header, sizeof(header), file); // CTracker Song
     
-    if (fscanf(file, "BPM: %d\n", &song->bpm) != 1) {
+    if (fscanf(file, "BPM: %d\n", &bpm) != 1 || bpm < MIN_BPM || bpm > MAX_BPM) {
         printf("Error reading BPM\n");
         fclose(file);
         return 0;
     }
     
-    if (fscanf(file, "Rows: %d\n", &song->num_rows) != 1) {
+    if (fscanf(file, "Rows: %d\n", &num_rows) != 1 || num_rows <= 0) {
         printf("Error reading rows\n");
         fclose(file);
         return 0;
     }
     
-    if (fscanf(file, "Channels: %d\n", &song->num_channels) != 1) {
+    if (fscanf(file, "Channels: %d\n", &num_channels) != 1 ||
+        num_channels <= 0 || num_channels > MAX_CHANNELS) {
         printf("Error reading channels\n");
         fclose(file);
         return 0;
     }
     
-    if (fscanf(file, "Loop: %d %d %d\n", &song->loop_enabled, &song->loop_start, &song->loop_end) != 3) {
+    if (fscanf(file, "Loop: %d %d %d\n", &loop_enabled, &loop_start, &loop_end) != 3) {
         printf("Error reading loop settings\n");
         fclose(file);
         return 0;
     }
     
-    int note_duration = get_note_duration_ms(song);
+    // Load into a new song so a bad file leaves the current one intact
+    Song loaded;
+    if (!song_init(&loaded, num_channels, num_rows)) {
+        printf("Error: Could not allocate song\n");
+        fclose(file);
+        return 0;
+    }
+    loaded.bpm = bpm;
     
-    // Read each cell
-    for (int ch = 0; ch < song->num_channels; ch++) {
-        for (int row = 0; row < song->num_rows; row++) {
-            Cell* c = &song->channels[ch].cells[row];
-            char note_str[16];
-            char sample[64];
-            
-            if (fscanf(file, "%d %d %15s %63[^\n]\n", 
-                   &c->note, &c->original_note, note_str, sample) != 4) {
-                printf("Error reading cell at channel %d, row %d\n", ch, row);
+    // Songs saved before the order list have a single pattern
+    int num_patterns = 1;
+    int has_order = fscanf(file, "Patterns: %d\n", &num_patterns) == 1;
+    if (has_order) {
+        int num_orders = 0;
+        int* order = NULL;
+        int ok = fscanf(file, "Order: %d", &num_orders) == 1 && num_orders > 0 && num_patterns > 0;
+        if (ok) order = malloc(num_orders * sizeof(int));
+        for (int i = 0; ok && order && i < num_orders; i++) {
+            if (fscanf(file, "%d", &order[i]) != 1) ok = 0;
+        }
+        
+        // Pattern 0 was created by song_init() with the header's row count
+        for (int p = 1; ok && order && p < num_patterns; p++) {
+            if (song_add_pattern(&loaded, num_rows) != p) ok = 0;
+        }
+        if (!ok || !order || !song_set_order(&loaded, order, num_orders)) {
+            printf("Error reading order list\n");
+            free(order);
+            song_free(&loaded);
+            fclose(file);
+            return 0;
+        }
+        free(order);
+    }
+    
+    // Read each pattern; only multi-pattern files have pattern headers
+    for (int p = 0; p < num_patterns; p++) {
+        int index, rows = num_rows;
+        if (has_order && (fscanf(file, " Pattern: %d %d\n", &index, &rows) != 2 || rows <= 0 ||
+                          (rows != loaded.patterns[p].num_rows &&
+                           !song_resize(&loaded, p, num_channels, rows)))) {
+            printf("Error reading pattern %d\n", p);
+            song_free(&loaded);
+            fclose(file);
+            return 0;
+        }
+        
+        if (!load_pattern_cells(file, &loaded, p)) {
+            song_free(&loaded);
+            fclose(file);
+            return 0;
+        }
+    }
+    
+    // Songs saved before effects end here; others list the channels
+    // whose effects differ from the defaults
+    int num_fx = 0;
+    if (fscanf(file, " Effects: %d", &num_fx) == 1) {
+        for (int i = 0; i < num_fx; i++) {
+            ChannelFx fx;
+            int ch;
+            if (fscanf(file, "%d %f %f %f %f %f %f %f", &ch, &fx.volume, &fx.pan, &fx.cutoff,
+                       &fx.delay_ms, &fx.feedback, &fx.delay_mix, &fx.send) != 8 ||
+                ch < 0 || ch >= MAX_CHANNELS) {
+                printf("Error reading channel effects\n");
+                song_free(&loaded);
                 fclose(file);
                 return 0;
             }
-            
-            // Clean up sample string (remove newline if present)
-            sample[strcspn(sample, "\n")] = 0;
-            
-            strcpy(c->sample, sample);
-            c->duration_ms = note_duration;
-            
-            if (c->note > 0 && c->original_note > 0) {
-                c->pitch_ratio = calculate_pitch_ratio(c->original_note, c->note);
-            } else {
-                c->pitch_ratio = 1.0;
-            }
+            loaded.fx[ch] = fx;
         }
     }
     
+    // The loop is checked against the final pattern sizes
+    loaded.loop_enabled = loop_enabled;
+    loaded.loop_start = loop_start;
+    loaded.loop_end = loop_end;
+    song_clamp_loop(&loaded);
+    
     fclose(file);
-    printf("Song loaded successfully: %d channels, %d rows, BPM: %d\n",
-           song->num_channels, song->num_rows, song->bpm);
+    
+    // Samples shared with the old song were acquired again above, so
+    // freeing it now does not decode anything twice
+    song_free(song);
+    *song = loaded;
+    
+    printf("Song loaded successfully: %d channels, %d patterns, %d rows, BPM: %d\n",
+           song->num_channels, song->num_patterns, song_length(song), song->bpm);
     
     return 1;
 }
 
-// ---- Save song to file ----
-int save_song(Song* song, const char* filename) {
+// ---- Save song to a text file ----
+int save_song_text(Song* song, const char* filename) {
     FILE* file = fopen(filename, "w");
     if (!file) {
         printf("Error: Could not create file %s\n", filename);
@@ -1036,27 +4616,407 @@ int save_song(Song* song, const char* filename) {
     // Write header
     fprintf(file, "CTracker Song\n");
     fprintf(file, "BPM: %d\n", song->bpm);
-    fprintf(file, "Rows: %d\n", song->num_rows);
+    fprintf(file, "Rows: %d\n", song->patterns[0].num_rows);
     fprintf(file, "Channels: %d\n", song->num_channels);
     fprintf(file, "Loop: %d %d %d\n", song->loop_enabled, song->loop_start, song->loop_end);
+    fprintf(file, "Patterns: %d\n", song->num_patterns);
+    
+    fprintf(file, "Order: %d", song->num_orders);
+    for (int i = 0; i < song->num_orders; i++) {
+        fprintf(file, " %d", song->order[i]);
+    }
+    fprintf(file, "\n");
+    
+    // Write each pattern, cells channel by channel
+    for (int p = 0; p < song->num_patterns; p++) {
+        fprintf(file, "Pattern: %d %d\n", p, song->patterns[p].num_rows);
+        
+        for (int ch = 0; ch < song->num_channels; ch++) {
+            for (int row = 0; row < song->patterns[p].num_rows; row++) {
+                Cell* c = song_cell(song, p, row, ch);
+                const char* note_name = midi_to_note_name(c->note);
+                
+                fprintf(file, "%d %d %s %s\n", 
+                       c->note, c->original_note, note_name, song->instruments[c->instrument].name);
+            }
+        }
+    }
+    
+    // Channel effects, only where they differ from the defaults
+    int num_fx = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1 && num_fx > 0) fprintf(file, "Effects: %d\n", num_fx);
+        for (int ch = 0; ch < song->num_channels; ch++) {
+            ChannelFx def = channel_fx_default(ch);
+            const ChannelFx* fx = &song->fx[ch];
+            if (memcmp(fx, &def, sizeof(def)) == 0) continue;
+            if (pass == 0) {
+                num_fx++;
+            } else {
+                fprintf(file, "%d %g %g %g %g %g %g %g\n", ch, fx->volume, fx->pan, fx->cutoff,
+                        fx->delay_ms, fx->feedback, fx->delay_mix, fx->send);
+            }
+        }
+    }
+    
+    fclose(file);
+    printf("Song saved successfully.\n");
+    
+    return 1;
+}
+
+// ---- Round a file offset up to the next 8-byte boundary ----
+uint64_t song_file_align(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// ---- Write zero bytes up to an aligned offset ----
+int song_file_pad(FILE* file, uint64_t from, uint64_t to) {
+    static const char zeros[8];
+    return to - from == 0 || fwrite(zeros, 1, to - from, file) == to - from;
+}
+
+// ---- Decoded sample of an instrument, if it can be packed ----
+const Sample* song_packable_sample(const Song* song, int instrument) {
+    const Sample* smp = song->instruments[instrument].smp;
+    return smp && smp->data && smp->len > 0 ? smp : NULL;
+}
+
+// ---- Save song to a binary file; 'pack' embeds the decoded samples ----
+int save_song_binary(Song* song, const char* filename, int pack) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        printf("Error: Could not create file %s\n", filename);
+        return 0;
+    }
+    
+    printf("Saving song to %s...\n", filename);
+    
+    // Lay out the sections: order, patterns, instruments, strings, cells,
+    // then the packed sample table and PCM
+    SongFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SONG_FILE_MAGIC, sizeof(h.magic));
+    h.version = SONG_FILE_VERSION;
+    h.byte_order = SONG_FILE_BYTE_ORDER;
+    h.header_size = sizeof(SongFileHeader);
+    h.cell_size = sizeof(Cell);
+    h.num_channels = song->num_channels;
+    h.bpm = song->bpm;
+    h.loop_enabled = song->loop_enabled;
+    h.loop_start = song->loop_start;
+    h.loop_end = song->loop_end;
+    h.num_patterns = song->num_patterns;
+    h.num_orders = song->num_orders;
+    h.num_instruments = song->num_instruments;
+    
+    h.order_offset = sizeof(SongFileHeader);
+    h.patterns_offset = song_file_align(h.order_offset + h.num_orders * sizeof(uint32_t));
+    h.instruments_offset = h.patterns_offset + h.num_patterns * sizeof(SongFilePattern);
+    h.strings_offset = song_file_align(h.instruments_offset + h.num_instruments * sizeof(uint32_t));
+    for (int i = 0; i < song->num_instruments; i++) {
+        h.strings_size += strlen(song->instruments[i].name) + 1;
+    }
     
-    // Write each cell
+    uint64_t cells_offset = song_file_align(h.strings_offset + h.strings_size);
+    h.file_size = cells_offset;
+    for (int p = 0; p < song->num_patterns; p++) {
+        h.file_size += (uint64_t)song->patterns[p].num_rows * song->num_channels * sizeof(Cell);
+    }
+    uint64_t cells_end = h.file_size;
+    
+    for (int i = 0; pack && i < song->num_instruments; i++) {
+        if (song_packable_sample(song, i)) h.num_samples++;
+    }
+    if (h.num_samples > 0) {
+        h.samples_offset = song_file_align(cells_end);
+        h.file_size = h.samples_offset + h.num_samples * sizeof(SongFileSample);
+        for (int i = 0; i < song->num_instruments; i++) {
+            const Sample* smp = song_packable_sample(song, i);
+            if (smp) h.file_size = song_file_align(h.file_size) + (uint64_t)smp->len * sizeof(Sint16);
+        }
+    }
+    
+    SongFileEffect effects[MAX_CHANNELS];
     for (int ch = 0; ch < song->num_channels; ch++) {
-        for (int row = 0; row < song->num_rows; row++) {
-            Cell* c = &song->channels[ch].cells[row];
-            const char* note_name = midi_to_note_name(c->note);
+        ChannelFx def = channel_fx_default(ch);
+        const ChannelFx* fx = &song->fx[ch];
+        if (memcmp(fx, &def, sizeof(def)) == 0) continue;
+        SongFileEffect fe = {ch, fx->volume, fx->pan, fx->cutoff, fx->delay_ms,
+                             fx->feedback, fx->delay_mix, fx->send};
+        effects[h.num_effects++] = fe;
+    }
+    uint64_t data_end = h.file_size;
+    if (h.num_effects > 0) {
+        h.effects_offset = song_file_align(data_end);
+        h.file_size = h.effects_offset + h.num_effects * sizeof(SongFileEffect);
+    }
+    
+    int ok = fwrite(&h, sizeof(h), 1, file) == 1;
+    
+    for (int i = 0; ok && i < song->num_orders; i++) {
+        uint32_t entry = song->order[i];
+        ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
+    }
+    ok = ok && song_file_pad(file, h.order_offset + h.num_orders * sizeof(uint32_t), h.patterns_offset);
+    
+    uint64_t next_cells = cells_offset;
+    for (int p = 0; ok && p < song->num_patterns; p++) {
+        SongFilePattern fp = {song->patterns[p].num_rows, 0, next_cells};
+        ok = fwrite(&fp, sizeof(fp), 1, file) == 1;
+        next_cells += (uint64_t)fp.num_rows * song->num_channels * sizeof(Cell);
+    }
+    
+    uint32_t name_offset = 0;
+    for (int i = 0; ok && i < song->num_instruments; i++) {
+        ok = fwrite(&name_offset, sizeof(name_offset), 1, file) == 1;
+        name_offset += strlen(song->instruments[i].name) + 1;
+    }
+    ok = ok && song_file_pad(file, h.instruments_offset + h.num_instruments * sizeof(uint32_t),
+                             h.strings_offset);
+    
+    for (int i = 0; ok && i < song->num_instruments; i++) {
+        const char* name = song->instruments[i].name;
+        ok = fwrite(name, 1, strlen(name) + 1, file) == strlen(name) + 1;
+    }
+    ok = ok && song_file_pad(file, h.strings_offset + h.strings_size, cells_offset);
+    
+    for (int p = 0; ok && p < song->num_patterns; p++) {
+        size_t count = (size_t)song->patterns[p].num_rows * song->num_channels;
+        ok = fwrite(song->patterns[p].cells, sizeof(Cell), count, file) == count;
+    }
+    
+    if (ok && h.num_samples > 0) {
+        ok = song_file_pad(file, cells_end, h.samples_offset);
+        
+        uint64_t data_offset = h.samples_offset + h.num_samples * sizeof(SongFileSample);
+        for (int i = 0; ok && i < song->num_instruments; i++) {
+            const Sample* smp = song_packable_sample(song, i);
+            if (!smp) continue;
+            
+            data_offset = song_file_align(data_offset);
+            SongFileSample fs = {i, smp->len, data_offset};
+            ok = fwrite(&fs, sizeof(fs), 1, file) == 1;
+            data_offset += (uint64_t)smp->len * sizeof(Sint16);
+        }
+        
+        uint64_t pos = h.samples_offset + h.num_samples * sizeof(SongFileSample);
+        for (int i = 0; ok && i < song->num_instruments; i++) {
+            const Sample* smp = song_packable_sample(song, i);
+            if (!smp) continue;
             
-            fprintf(file, "%d %d %s %s\n", 
-                   c->note, c->original_note, note_name, c->sample);
+            ok = song_file_pad(file, pos, song_file_align(pos)) &&
+                 fwrite(smp->data, sizeof(Sint16), smp->len, file) == smp->len;
+            pos = song_file_align(pos) + (uint64_t)smp->len * sizeof(Sint16);
         }
     }
     
-    fclose(file);
+    if (ok && h.num_effects > 0) {
+        ok = song_file_pad(file, data_end, h.effects_offset) &&
+             fwrite(effects, sizeof(SongFileEffect), h.num_effects, file) == h.num_effects;
+    }
+    
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) {
+        printf("Error: Could not write %s\n", filename);
+        return 0;
+    }
+    
+    if (h.num_samples > 0) printf("Packed %u samples.\n", h.num_samples);
     printf("Song saved successfully.\n");
+    return 1;
+}
+
+// ---- Section of a mapped song file, or NULL if it falls outside ----
+void* song_file_section(void* map, size_t size, uint64_t offset, uint64_t count, size_t elem) {
+    if (offset % 8 != 0 || offset > size || count > (size - offset) / elem) return NULL;
+    return (char*)map + offset;
+}
+
+// ---- Instrument name 'index' of a song file; NULL if damaged ----
+// Names are held to the longest path the sample bank keeps, as in text files.
+const char* song_file_name(const SongFileHeader* h, const char* strings, const uint32_t* names, uint32_t index) {
+    if (index >= h->num_instruments || names[index] >= h->strings_size) return NULL;
+    
+    const char* name = strings + names[index];
+    size_t left = h->strings_size - names[index];
+    return strnlen(name, left) < sizeof(sample_bank[0].path) ? name : NULL;
+}
+
+// ---- Load song from a binary file, mapped and used in place ----
+// The mapping is private, so editing cells never writes to the file.
+int load_song_binary(Song* song, const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Could not open file %s\n", filename);
+        return 0;
+    }
+    
+    printf("Loading song from %s...\n", filename);
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < offsetof(SongFileHeader, samples_offset)) {
+        printf("Error: %s is not a song file\n", filename);
+        close(fd);
+        return 0;
+    }
+    
+    size_t size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Error: Could not map %s\n", filename);
+        return 0;
+    }
+    
+    const SongFileHeader* h = map;
+    if (memcmp(h->magic, SONG_FILE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version < 1 || h->version > SONG_FILE_VERSION || h->byte_order != SONG_FILE_BYTE_ORDER ||
+        h->header_size < (h->version >= 3 ? sizeof(SongFileHeader) :
+                          h->version == 2 ? offsetof(SongFileHeader, effects_offset) :
+                          offsetof(SongFileHeader, samples_offset)) ||
+        h->header_size > size ||
+        h->cell_size != sizeof(Cell) ||
+        h->file_size > size) {
+        printf("Error: %s is not a song file this version can read on this machine\n", filename);
+        munmap(map, size);
+        return 0;
+    }
+    
+    uint32_t* order = song_file_section(map, size, h->order_offset, h->num_orders, sizeof(uint32_t));
+    SongFilePattern* patterns = song_file_section(map, size, h->patterns_offset, h->num_patterns,
+                                                  sizeof(SongFilePattern));
+    uint32_t* names = song_file_section(map, size, h->instruments_offset, h->num_instruments,
+                                        sizeof(uint32_t));
+    char* strings = song_file_section(map, size, h->strings_offset, h->strings_size, 1);
+    if (!order || !patterns || !names || !strings || h->strings_size == 0 ||
+        strings[h->strings_size - 1] != '\0' || h->num_channels == 0 ||
+        h->num_channels > MAX_CHANNELS || h->bpm < MIN_BPM || h->bpm > MAX_BPM ||
+        h->num_patterns == 0 || h->num_orders == 0 ||
+        h->num_instruments == 0 || h->num_instruments > UINT16_MAX + 1) {
+        printf("Error: %s is damaged\n", filename);
+        munmap(map, size);
+        return 0;
+    }
+    
+    // Load into a new song so a bad file leaves the current one intact;
+    // from here on song_free() also unmaps the file
+    Song loaded;
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.num_channels = h->num_channels;
+    loaded.bpm = h->bpm;
+    loaded.file_map = map;
+    loaded.file_map_size = size;
+    song_fx_reset(&loaded);
+    
+    // Packed samples go into the bank first, so song_instrument() finds them
+    // there instead of opening and decoding each file
+    uint32_t num_samples = h->version >= 2 ? h->num_samples : 0;
+    SongFileSample* packed = num_samples > 0 ?
+        song_file_section(map, size, h->samples_offset, num_samples, sizeof(SongFileSample)) : NULL;
+    Sample* held[MAX_SAMPLES];
+    int num_held = 0;
+    int ok = num_samples == 0 || packed;
+    
+    for (uint32_t i = 0; ok && i < num_samples && num_held < MAX_SAMPLES; i++) {
+        Sint16* data = song_file_section(map, size, packed[i].data_offset, packed[i].len, sizeof(Sint16));
+        const char* name = song_file_name(h, strings, names, packed[i].instrument);
+        ok = data && name;
+        if (ok) held[num_held] = sample_bank_adopt(name, data, packed[i].len);
+        if (ok && held[num_held]) num_held++;
+    }
+    
+    for (uint32_t i = 0; ok && i < h->num_instruments; i++) {
+        const char* name = song_file_name(h, strings, names, i);
+        ok = name && song_instrument(&loaded, name) == (int)i;
+    }
+    
+    for (int i = 0; i < num_held; i++) sample_bank_release(held[i]);
+    
+    loaded.patterns = ok ? calloc(h->num_patterns, sizeof(Pattern)) : NULL;
+    for (uint32_t p = 0; loaded.patterns && ok && p < h->num_patterns; p++) {
+        uint64_t count = (uint64_t)patterns[p].num_rows * h->num_channels;
+        Cell* cells = song_file_section(map, size, patterns[p].cells_offset, count, sizeof(Cell));
+        ok = cells && patterns[p].num_rows > 0 && patterns[p].num_rows <= INT32_MAX / MAX_CHANNELS;
+        
+        // Cells are used as stored, so check everything the engine indexes with
+        for (uint64_t i = 0; ok && i < count; i++) {
+            ok = cells[i].note < TOTAL_NOTES && cells[i].original_note < TOTAL_NOTES &&
+                 cells[i].instrument < h->num_instruments;
+        }
+        if (ok) {
+            loaded.patterns[p].num_rows = patterns[p].num_rows;
+            loaded.patterns[p].cells = cells;
+            loaded.num_patterns++;
+        }
+    }
+    
+    int* entries = ok && loaded.patterns ? malloc(h->num_orders * sizeof(int)) : NULL;
+    for (uint32_t i = 0; entries && i < h->num_orders; i++) {
+        entries[i] = order[i] < h->num_patterns ? (int)order[i] : -1;
+    }
+    if (!entries || !song_set_order(&loaded, entries, h->num_orders)) {
+        printf("Error: %s is damaged\n", filename);
+        free(entries);
+        song_free(&loaded);
+        return 0;
+    }
+    free(entries);
+    
+    uint32_t num_effects = h->version >= 3 ? h->num_effects : 0;
+    SongFileEffect* effects = num_effects > 0 ?
+        song_file_section(map, size, h->effects_offset, num_effects, sizeof(SongFileEffect)) : NULL;
+    if (num_effects > 0 && !effects) {
+        printf("Error: %s is damaged\n", filename);
+        song_free(&loaded);
+        return 0;
+    }
+    for (uint32_t i = 0; i < num_effects; i++) {
+        const SongFileEffect* fe = &effects[i];
+        if (fe->channel >= MAX_CHANNELS) continue;
+        ChannelFx fx = {fe->volume, fe->pan, fe->cutoff, fe->delay_ms, fe->feedback, fe->delay_mix, fe->send};
+        loaded.fx[fe->channel] = fx;
+    }
+    
+    loaded.loop_enabled = h->loop_enabled;
+    loaded.loop_start = h->loop_start;
+    loaded.loop_end = h->loop_end;
+    song_clamp_loop(&loaded);
+    song_sweep_instruments(&loaded); // A saved table may name samples no cell plays
+    
+    song_free(song);
+    *song = loaded;
+    
+    printf("Song loaded successfully: %d channels, %d patterns, %d rows, BPM: %d\n",
+           song->num_channels, song->num_patterns, song_length(song), song->bpm);
     
     return 1;
 }
 
+// ---- Load song from file; binary files are recognised by their magic ----
+int load_song(Song* song, const char* filename) {
+    char magic[sizeof(SONG_FILE_MAGIC) - 1];
+    FILE* file = fopen(filename, "rb");
+    int binary = file && fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                 memcmp(magic, SONG_FILE_MAGIC, sizeof(magic)) == 0;
+    if (file) fclose(file);
+    
+    return binary ? load_song_binary(song, filename) : load_song_text(song, filename);
+}
+
+// ---- Whether a file name selects the binary format ----
+int song_file_is_ctb(const char* filename) {
+    const char* ext = strrchr(filename, '.');
+    return ext && strcmp(ext, ".ctb") == 0;
+}
+
+// ---- Save song to file; a .ctb name selects the binary format ----
+// 'pack' embeds the samples, which only the binary format can hold.
+int save_song(Song* song, const char* filename, int pack) {
+    if (song_file_is_ctb(filename)) return save_song_binary(song, filename, pack);
+    return save_song_text(song, filename);
+}
+
 // ---- Save song to WAV file (export) ----
 void export_to_wav(Song* song) {
     char filename[256];
@@ -1069,9 +5029,43 @@ void export_to_wav(Song* song) {
         strcpy(filename, "song.wav");
     }
     
+    char threads[16];
+    printf("Render threads, 0 = one per CPU (Enter to keep %d): ", render_options.threads);
+    fgets(threads, sizeof(threads), stdin);
+    if (threads[0] != '\n' && threads[0] != '\0' && atoi(threads) >= 0) {
+        render_options.threads = atoi(threads);
+    }
+    
+    char dither[16];
+    printf("Dither output (y/n, Enter to keep %s): ", render_options.dither ? "y" : "n");
+    fgets(dither, sizeof(dither), stdin);
+    if (tolower(dither[0]) == 'y') render_options.dither = 1;
+    if (tolower(dither[0]) == 'n') render_options.dither = 0;
+    
+    char interp[16];
+    printf("Sample interpolation, l = linear, s = sinc (Enter to keep %s): ",
+           render_options.interp == INTERP_SINC ? "s" : "l");
+    fgets(interp, sizeof(interp), stdin);
+    if (tolower(interp[0]) == 'l') render_options.interp = INTERP_LINEAR;
+    if (tolower(interp[0]) == 's') render_options.interp = INTERP_SINC;
+    
+    if (song->loop_enabled) {
+        char loops[16];
+        int current = render_options.loops > 0 ? render_options.loops : EXPORT_LOOPS;
+        printf("Loop repeats (Enter to keep %d): ", current);
+        fgets(loops, sizeof(loops), stdin);
+        if (atoi(loops) > 0) render_options.loops = atoi(loops);
+    }
+    
+    char stems[16];
+    printf("Also write a WAV per channel (y/n, Enter to keep %s): ", render_options.stems ? "y" : "n");
+    fgets(stems, sizeof(stems), stdin);
+    if (tolower(stems[0]) == 'y') render_options.stems = 1;
+    if (tolower(stems[0]) == 'n') render_options.stems = 0;
+    
     printf("Exporting to %s...\n", filename);
     
-    if (save_song_to_wav(song, filename)) {
+    if (save_song_to_wav(song, filename, &render_options)) {
         printf("Export successful!\n");
     } else {
         printf("Export failed!\n");
@@ -1103,7 +5097,7 @@ void load_song_from_file(Song* song) {
 void save_song_to_file(Song* song) {
     char filename[256];
     
-    printf("Enter song filename to save: ");
+    printf("Enter song filename to save (.ctb = binary): ");
     fgets(filename, sizeof(filename), stdin);
     filename[strcspn(filename, "\n")] = 0;
     
@@ -1111,7 +5105,16 @@ void save_song_to_file(Song* song) {
         strcpy(filename, "song.ctrack");
     }
     
-    if (save_song(song, filename)) {
+    // Packed songs load with no sample files to open or convert
+    int pack = 0;
+    if (song_file_is_ctb(filename)) {
+        char answer[16];
+        printf("Pack samples into the file (y/n): ");
+        fgets(answer, sizeof(answer), stdin);
+        pack = tolower(answer[0]) == 'y';
+    }
+    
+    if (save_song(song, filename, pack)) {
         printf("Song saved successfully!\n");
     } else {
         printf("Failed to save song!\n");
@@ -1121,48 +5124,139 @@ void save_song_to_file(Song* song) {
     getchar();
 }
 
-// ---- Main ----
-int main() {
-    Song song = {0};
-    song.num_channels = MAX_CHANNELS;  // 8 channels
-    song.num_rows = MAX_ROWS;
-    song.bpm = 120;  // Default BPM value
-    song.loop_enabled = 0;
-    song.loop_start = 0;
-    song.loop_end = MAX_ROWS - 1;
+// ---- Command-line usage ----
+void print_usage(const char* program) {
+    printf("Usage: %s                      Interactive tracker\n", program);
+    printf("       %s --render IN OUT [IN OUT ...] [--threads N] [--dither] [--sinc] [--loops N] [--stems] [--segment FIRST:END]\n", program);
+    printf("                               Render songs to WAV without a terminal or audio device\n");
+    printf("       %s --merge OUT SEGMENT [SEGMENT ...]\n", program);
+    printf("                               Join --segment renders into one WAV file\n");
+}
+
+// ---- Headless batch render: songs on the command line to WAV files ----
+// Returns the process exit status: 0 only if every song rendered.
+int render_main(int argc, char** argv) {
+    RenderOptions opts = {0};
+    const char* files[argc];
+    int num_files = 0;
+    
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            opts.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dither") == 0) {
+            opts.dither = 1;
+        } else if (strcmp(argv[i], "--sinc") == 0) {
+            opts.interp = INTERP_SINC;
+        } else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc) {
+            opts.loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stems") == 0) {
+            opts.stems = 1;
+        } else if (strcmp(argv[i], "--segment") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d:%d", &opts.segment_start, &opts.segment_end) != 2 ||
+                opts.segment_start < 0 || opts.segment_end <= opts.segment_start) {
+                printf("Invalid segment %s (rows FIRST:END, END not included)\n", argv[i]);
+                return 2;
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            printf("Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 2;
+        } else {
+            files[num_files++] = argv[i];
+        }
+    }
+    if (num_files == 0 || num_files % 2 != 0 || opts.threads < 0 || opts.loops < 0) {
+        print_usage(argv[0]);
+        return 2;
+    }
     
-    // Initialize note durations and pitch ratios
-    int note_duration = get_note_duration_ms(&song);
-    for (int ch = 0; ch < song.num_channels; ch++) {
-        for (int row = 0; row < song.num_rows; row++) {
-            song.channels[ch].cells[row].duration_ms = note_duration;
-            song.channels[ch].cells[row].original_note = 60; // Default C4
-            song.channels[ch].cells[row].pitch_ratio = 1.0;
+    // Samples are decoded straight from the WAV files; no audio device
+    // is opened, so nothing here needs SDL_Init()
+    int failed = 0;
+    for (int i = 0; i < num_files; i += 2) {
+        Song song;
+        if (!song_init(&song, DEFAULT_CHANNELS, DEFAULT_ROWS)) {
+            printf("Error: Could not allocate song\n");
+            return 1;
+        }
+        if (!load_song(&song, files[i]) || !save_song_to_wav(&song, files[i + 1], &opts)) {
+            printf("Error: Could not render %s\n", files[i]);
+            failed++;
         }
+        song_free(&song);
+    }
+    
+    if (num_files > 2) printf("Rendered %d of %d songs\n", num_files / 2 - failed, num_files / 2);
+    return failed ? 1 : 0;
+}
+
+#ifndef CTRACKER_NO_MAIN
+// ---- Main ----
+int main(int argc, char** argv) {
+    mix_kernels_init();
+    pitch_table_init();
+    oscillator_init();
+    resampler_init();
+
+    if (argc > 1 && strcmp(argv[1], "--render") == 0) return render_main(argc, argv);
+    if (argc > 3 && strcmp(argv[1], "--merge") == 0) {
+        return merge_wav_segments(argv[2], (const char**)argv + 3, argc - 3) ? 0 : 1;
+    }
+    if (argc > 1) {
+        print_usage(argv[0]);
+        return strcmp(argv[1], "--help") == 0 ? 0 : 2;
+    }
+
+    Song song;
+    if (!song_init(&song, DEFAULT_CHANNELS, DEFAULT_ROWS)) {
+        printf("Error: Could not allocate song\n");
+        return 1;
+    }
+
+    // Open the audio engine once for the whole session
+    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+        printf("SDL_Init error: %s\n", SDL_GetError());
+    } else if (engine_open() && midi_open()) {
+        // MIDI can start the song before anything else publishes it
+        engine_publish(&song);
     }
 
+    // Keys are polled with select(), so stdin must not read ahead of it
+    setvbuf(stdin, NULL, _IONBF, 0);
+    
     int cursor_row = 0, cursor_channel = 0;
+    int pattern = 0;
     int running = 1;
+    int was_playing = 0;
 
     while (running) {
-        draw_tty(&song, cursor_row, cursor_channel);
-        printf("\nControls:\n");
-        printf("WASD - navigation\n");
-        printf("E - edit cell\n");
-        printf("P - play entire track\n");
-        printf("R - play current row\n");
-        printf("B - change BPM (current: %d)\n", song.bpm);
-        printf("L - set loop points\n");
-        printf("F - save song to file\n");
-        printf("G - load song from file\n");
-        printf("X - export to WAV file\n");
-        printf("Q - quit\n");
-        printf("\nNote format: NoteName+Octave (e.g., C4, A#3, F-1)\n");
-        printf("Use '---' for rest/silence\n");
-        printf("Samples will be pitch-shifted to match the note!\n");
+        // Loading or resizing can leave the cursor outside the pattern
+        if (pattern >= song.num_patterns) pattern = song.num_patterns - 1;
+        if (cursor_row >= song.patterns[pattern].num_rows) cursor_row = song.patterns[pattern].num_rows - 1;
+        if (cursor_channel >= song.num_channels) cursor_channel = song.num_channels - 1;
         
-        int c = getch();
+        // The audio callback plays on by itself; the view just follows it
+        int play_row, loops, finished;
+        SongPos pos;
+        engine_status(&play_row, &loops, &finished);
+        int shown = play_row >= 0 && song_pos_at(&song, play_row, &pos) && pos.pattern == pattern;
+        
+        // Log the counters of each playback once it is over
+        if (was_playing && play_row < 0) engine_stats_log(&song);
+        was_playing = play_row >= 0;
+        
+        if (midi.open) midi_follow_cursor(&song, pattern, cursor_row);
+        draw_tty(&song, pattern, cursor_row, cursor_channel, shown ? pos.row : -1);
+        draw_status(&song, play_row, loops);
+        draw_engine_stats();
+        draw_controls(&song, pattern);
+        screen_flush();
+        
+        // Wake up regularly while playing to move the playhead
+        int c = poll_key(play_row >= 0 ? 20 : 200);
+        if (c == 0) continue;
         switch(c) {
+            case EOF:
             case 'q': 
                 running = 0; 
                 break;
@@ -1170,7 +5264,7 @@ int main() {
                 if(cursor_row > 0) cursor_row--; 
                 break;
             case 's': 
-                if(cursor_row < song.num_rows - 1) cursor_row++; 
+                if(cursor_row < song.patterns[pattern].num_rows - 1) cursor_row++; 
                 break;
             case 'a': 
                 if(cursor_channel > 0) cursor_channel--; 
@@ -1179,13 +5273,19 @@ int main() {
                 if(cursor_channel < song.num_channels - 1) cursor_channel++; 
                 break;
             case 'e': 
-                edit_cell(&song, cursor_row, cursor_channel); 
+                edit_cell(&song, pattern, cursor_row, cursor_channel); 
                 break;
             case 'p': 
-                play_song(&song); 
+                if (engine.device == 0) {
+                    break;
+                } else if (play_row >= 0) {
+                    engine_stop_all();
+                } else {
+                    engine_play(&song, 0);
+                }
                 break;
             case 'r':
-                play_current_row(&song, cursor_row);
+                if (engine.device != 0) engine_preview(&song, pattern, cursor_row);
                 break;
             case 'b': 
                 change_bpm(&song); 
@@ -1193,6 +5293,25 @@ int main() {
             case 'l':
                 set_loop(&song);
                 break;
+            case 'n':
+                resize_pattern(&song, pattern);
+                break;
+            case '[':
+                if (pattern > 0) pattern--;
+                break;
+            case ']':
+                if (pattern == song.num_patterns - 1 &&
+                    song_add_pattern(&song, song.patterns[pattern].num_rows) < 0) {
+                    break;
+                }
+                pattern++;
+                break;
+            case 'o':
+                edit_order(&song);
+                break;
+            case 'c':
+                edit_channel_fx(&song, cursor_channel);
+                break;
             case 'f':
                 save_song_to_file(&song);
                 break;
@@ -1203,17 +5322,22 @@ int main() {
                 export_to_wav(&song);
                 break;
         }
+        
+        // Anything but navigation and transport may have printed to the
+        // terminal or changed the song
+        if (!strchr("wasd[]pr", c)) {
+            screen_invalidate();
+            engine_publish(&song);
+        }
     }
 
     // Stop all playback before exit
-    for (int i = 0; i < MAX_CHANNELS; i++) {
-        pthread_mutex_lock(&audio_mutex);
-        tone_threads[i].active = 0;
-        sample_threads[i].active = 0;
-        pthread_mutex_unlock(&audio_mutex);
-    }
-    
-    SDL_Delay(100);
+    if (was_playing) engine_stats_log(&song);
+    midi_close();
+    engine_close();
+    SDL_Quit();
+    song_free(&song);
     
     return 0;
 }
+#endif
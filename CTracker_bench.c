@@ -0,0 +1,471 @@
+// CTracker_bench.c
+// Benchmarks for the engine hot paths, no TTY or audio device needed:
+//   ./CTracker_bench [seconds of audio] [mix|voices|export|files]
+// Every section runs when none is named.
+#include <stdlib.h>
+
+// ---- Heap calls made by CTracker.c, counted through the macros below ----
+long long bench_allocs;
+
+void* bench_malloc(size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void* bench_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(count, size);
+}
+
+void* bench_realloc(void* p, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(p, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(p, size) bench_realloc(p, size)
+
+#define CTRACKER_NO_MAIN
+#include "CTracker.c"
+#include <time.h>
+
+#define BENCH_CHANNELS 8
+#define BENCH_ROWS 64              // Rows per synthetic pattern
+#define BENCH_MIN_TIME 0.5         // Repeat short runs for at least this long (s)
+
+// ---- Monotonic time in seconds ----
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ---- Send stdout to /dev/null while 'quiet' is set, so progress output stays out of the table ----
+void bench_quiet(int quiet) {
+    static int saved = -1;
+
+    fflush(stdout);
+    if (quiet && saved < 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd < 0) return;
+        saved = dup(STDOUT_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    } else if (!quiet && saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        saved = -1;
+    }
+}
+
+// ---- Print one result line: rate in samples per second and realtime factor ----
+void bench_report(const char* name, double seconds, double frames) {
+    printf("%-22s %9.2f ms  %8.2f Msamples/s  %9.1f x realtime\n", name, seconds * 1e3,
+           frames / seconds / 1e6, frames / SAMPLE_RATE / seconds);
+}
+
+// ---- Old export mix: per-sample pan and three clamps per channel ----
+void legacy_mix(Sint16 in[][VOICE_BLOCK], Sint16* out, Uint32 frames) {
+    Sint16 row_buffer[VOICE_BLOCK * 2];
+
+    memset(out, 0, frames * 2 * sizeof(Sint16));
+    for (int ch = 0; ch < BENCH_CHANNELS; ch++) {
+        memset(row_buffer, 0, sizeof(row_buffer));
+        for (Uint32 i = 0; i < frames; i++) {
+            float pan = ch < 4 ? 0.7f : 0.3f;
+            int k = ch < 4 ? i*2 : i*2+1;
+            int mixed = row_buffer[k] + (Sint16)(in[ch][i] * (ch < 4 ? pan : 1.0f - pan));
+            if (mixed > 32767) mixed = 32767;
+            if (mixed < -32768) mixed = -32768;
+            row_buffer[k] = (Sint16)mixed;
+        }
+        for (Uint32 i = 0; i < frames * 2; i++) {
+            int mixed = out[i] + row_buffer[i];
+            if (mixed > 32767) mixed = 32767;
+            if (mixed < -32768) mixed = -32768;
+            out[i] = (Sint16)mixed;
+        }
+    }
+}
+
+// ---- Kernel mix, as done by mix_voices() and bus_to_s16() ----
+void kernel_mix(const MixKernels* k, float in[][VOICE_BLOCK], const float* noise,
+                Sint16* out, Uint32 frames) {
+    float bus[VOICE_BLOCK * 2];
+
+    memset(bus, 0, frames * 2 * sizeof(float));
+    for (int ch = 0; ch < BENCH_CHANNELS; ch++) {
+        ChannelFx fx = channel_fx_default(ch);
+        float gain_l, gain_r;
+        channel_gains(&fx, &gain_l, &gain_r);
+        k->mix_pan(bus, in[ch], frames, gain_l, gain_r);
+    }
+    k->quantize(out, bus, noise, frames * 2);
+}
+
+// ---- Mix kernels against the old mixer; returns 0 if a kernel disagrees ----
+int bench_mix(double seconds) {
+    Uint32 blocks = (Uint32)(seconds * SAMPLE_RATE / VOICE_BLOCK);
+    if (blocks == 0) blocks = 1;
+
+    // Loud random input so the clamps are exercised too
+    static Sint16 in[BENCH_CHANNELS][VOICE_BLOCK];
+    static float in_f[BENCH_CHANNELS][VOICE_BLOCK];
+    srand(1);
+    for (int ch = 0; ch < BENCH_CHANNELS; ch++) {
+        for (int i = 0; i < VOICE_BLOCK; i++) {
+            in[ch][i] = (Sint16)(rand() % 65536 - 32768);
+            in_f[ch][i] = in[ch][i];
+        }
+    }
+
+    // Dithered output stage, as used by export
+    float noise[VOICE_BLOCK * 2];
+    dither_fill(noise, 0, VOICE_BLOCK * 2);
+
+    Sint16 ref[VOICE_BLOCK * 2];
+    Sint16 out[VOICE_BLOCK * 2];
+    kernel_mix(&MIX_KERNEL_TABLE[0], in_f, noise, ref, VOICE_BLOCK);
+
+    printf("\nMixing %d channels, %.0f s of audio (%u blocks of %d frames)\n",
+           BENCH_CHANNELS, seconds, blocks, VOICE_BLOCK);
+
+    volatile Sint32 sink = 0;
+    double frames = (double)blocks * VOICE_BLOCK;
+    double start = bench_now();
+    for (Uint32 b = 0; b < blocks; b++) {
+        legacy_mix(in, out, VOICE_BLOCK);
+        sink += out[b % (VOICE_BLOCK * 2)];
+    }
+    double legacy = bench_now() - start;
+    bench_report("legacy", legacy, frames);
+
+    for (int i = 0; i < NUM_MIX_KERNELS; i++) {
+        const MixKernels* k = &MIX_KERNEL_TABLE[i];
+        if (!mix_kernels_supported(k)) {
+            printf("%-22s not supported on this CPU\n", k->name);
+            continue;
+        }
+
+        start = bench_now();
+        for (Uint32 b = 0; b < blocks; b++) {
+            kernel_mix(k, in_f, noise, out, VOICE_BLOCK);
+            sink += out[b % (VOICE_BLOCK * 2)];
+        }
+        double t = bench_now() - start;
+
+        int exact = memcmp(out, ref, sizeof(ref)) == 0;
+        bench_report(k->name, t, frames);
+        printf("%-22s %5.2fx vs legacy%s\n", "", legacy / t, exact ? "" : "  MISMATCH vs scalar");
+        if (!exact) return 0;
+    }
+    return 1;
+}
+
+// ---- Voice rendering: oscillators, and samples read at several pitch ratios ----
+// This is the pitch shifting path: samples are resampled while they are
+// read, with linear interpolation for playback and sinc for export.
+int bench_voices(double seconds) {
+    static Sint16 pcm[SAMPLE_RATE];
+    srand(2);
+    for (int i = 0; i < SAMPLE_RATE; i++) pcm[i] = (Sint16)(rand() % 65536 - 32768);
+
+    Sample smp = {.data = pcm, .len = SAMPLE_RATE};
+    Instrument sample_ins = {"bench", -1, &smp, envelope_default(-1), 0};
+    Instrument tone_ins = {"saw", WAVE_SAW, NULL, envelope_default(WAVE_SAW), 0};
+    const double ratios[] = {0.5, 1.0, 1.5, 2.0, 3.7};
+    Uint32 blocks = (Uint32)(seconds * SAMPLE_RATE / VOICE_BLOCK);
+    if (blocks == 0) blocks = 1;
+
+    printf("\nRendering one voice, %.0f s of audio\n", seconds);
+
+    float out[VOICE_BLOCK];
+    volatile float sink = 0;
+    long long allocs = bench_allocs;
+    int num_ratios = (int)(sizeof(ratios) / sizeof(ratios[0]));
+    for (int run = -1; run < num_ratios * 2; run++) {
+        int r = run % num_ratios;
+        int sinc = run >= num_ratios;
+        Cell cell = {.note = 60, .original_note = 60, .pitch_ratio = run < 0 ? 1.0f : (float)ratios[r]};
+        const Instrument* ins = run < 0 ? &tone_ins : &sample_ins;
+        Voice v;
+
+        double start = bench_now();
+        voice_start(&v, &cell, ins, UINT32_MAX);
+        if (sinc) voice_use_sinc(&v);
+        for (Uint32 b = 0; b < blocks; b++) {
+            // Retrigger when the sample runs out
+            if (voice_render(&v, out, VOICE_BLOCK) < VOICE_BLOCK) {
+                voice_start(&v, &cell, ins, UINT32_MAX);
+                if (sinc) voice_use_sinc(&v);
+            }
+            sink += out[b % VOICE_BLOCK];
+        }
+        double t = bench_now() - start;
+
+        char name[32];
+        if (run < 0) snprintf(name, sizeof(name), "tone (saw)");
+        else snprintf(name, sizeof(name), "%s x%.2f", sinc ? "sinc" : "linear", ratios[r]);
+        bench_report(name, t, (double)blocks * VOICE_BLOCK);
+    }
+
+    // Voices are started and rendered on the audio thread too
+    printf("%-22s %9lld heap allocations\n", "all voices", bench_allocs - allocs);
+    return 1;
+}
+
+// ---- Write a short decaying noise burst as a mono WAV, to use as a drum ----
+int bench_write_sample(const char* path) {
+    Uint32 frames = SAMPLE_RATE / 4;
+    Sint16* pcm = malloc(frames * sizeof(Sint16));
+    if (!pcm) return 0;
+
+    srand(3);
+    for (Uint32 i = 0; i < frames; i++) {
+        double env = exp(-8.0 * i / frames);
+        pcm[i] = (Sint16)((rand() % 65536 - 32768) * 0.5 * env);
+    }
+
+    WavHeader header;
+    wav_header_init(&header, frames);
+    header.num_channels = 1;
+    header.block_align = 2;
+    header.byte_rate = SAMPLE_RATE * 2;
+    header.data_size = frames * 2;
+    header.file_size = header.data_size + sizeof(WavHeader) - 8;
+
+    FILE* f = fopen(path, "wb");
+    int ok = f && fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(pcm, sizeof(Sint16), frames, f) == frames;
+    if (f && fclose(f) != 0) ok = 0;
+    free(pcm);
+    return ok;
+}
+
+// ---- Synthetic 8-channel song: 'patterns' distinct random patterns played in order ----
+// Channels 0-3 mostly play the drum sample, 4-7 mostly tones.
+int bench_song(Song* song, int patterns, const char* sample_path) {
+    if (!song_init(song, BENCH_CHANNELS, BENCH_ROWS)) return 0;
+    song->bpm = 125;
+
+    const char* names[] = {sample_path, "sine", "square", "saw"};
+    int instruments[4];
+    for (int i = 0; i < 4; i++) {
+        instruments[i] = song_instrument(song, names[i]);
+        if (instruments[i] < 0) return 0;
+    }
+
+    int* order = malloc(patterns * sizeof(int));
+    if (!order) return 0;
+
+    srand(4);
+    for (int p = 0; p < patterns; p++) {
+        if (p > 0 && song_add_pattern(song, BENCH_ROWS) < 0) {
+            free(order);
+            return 0;
+        }
+        order[p] = p;
+
+        for (int r = 0; r < BENCH_ROWS; r++) {
+            for (int ch = 0; ch < BENCH_CHANNELS; ch++) {
+                Cell* c = song_cell(song, p, r, ch);
+                if (rand() % 100 >= 40) continue;
+
+                int drum = ch < 4 ? rand() % 4 != 0 : rand() % 4 == 0;
+                c->note = (Uint8)(36 + rand() % 48);
+                c->instrument = (Uint16)instruments[drum ? 0 : 1 + rand() % 3];
+                c->pitch_ratio = drum ? calculate_pitch_ratio(c->original_note, c->note) : 1.0f;
+            }
+        }
+    }
+
+    int ok = song_set_order(song, order, patterns);
+    song->loop_end = song_length(song) - 1;
+    free(order);
+    return ok;
+}
+
+// ---- Offline export of songs of increasing length ----
+// Each starts from an empty render cache, except "cell edit": one cell
+// is changed and the song exported again from the rows already cached,
+// and "unchanged", which exports it once more as it is.
+// "loop x4" plays the whole song as a loop body four times, "segment"
+// renders its last quarter only, and "stems" is "effects" again, writing
+// every channel and the reverb too.
+// Heap calls are counted too: an unchanged song takes none.
+int bench_export(const char* sample_path, const char* wav_path) {
+    const int lengths[] = {2, 8, 32};
+
+    printf("\nExporting %d-channel songs of %d-row patterns to WAV\n", BENCH_CHANNELS, BENCH_ROWS);
+
+    for (int l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++) {
+        Song song;
+        if (!bench_song(&song, lengths[l], sample_path)) {
+            printf("Error: Could not build the benchmark song\n");
+            return 0;
+        }
+
+        // Modes: 1 thread, all CPUs, cell edit, unchanged, sinc, loop x4, segment, effects, stems
+        for (int pass = 0; pass < 9; pass++) {
+            RenderOptions opts = {pass == 1 ? 0 : 1, 0, pass == 4 ? INTERP_SINC : INTERP_LINEAR, 4, pass == 8, 0, 0};
+            song.loop_enabled = pass == 5;
+            if (pass == 6) opts.segment_start = song_length(&song) * 3 / 4;
+            if (pass == 2) {
+                Cell tone = {72, 0, 0, 1.0f};
+                *song_cell(&song, 0, 1, 0) = tone;
+            } else if (pass != 3) {
+                render_cache_free(&render_cache);
+            }
+            for (int ch = 0; pass == 7 && ch < BENCH_CHANNELS; ch++) {
+                ChannelFx* fx = &song.fx[ch];
+                fx->cutoff = 3000.0f;
+                fx->delay_ms = 180.0f;
+                fx->feedback = 0.4f;
+                fx->delay_mix = 0.3f;
+                fx->send = 0.2f;
+            }
+
+            RenderPlan plan;
+            render_plan_init(&plan, &song, opts.loops);
+            Uint32 frames = plan.total_frames - (Uint32)row_clock_total(song.bpm, opts.segment_start);
+
+            bench_quiet(1);
+            long long allocs = bench_allocs;
+            double start = bench_now();
+            int ok = save_song_to_wav(&song, wav_path, &opts);
+            double t = bench_now() - start;
+            allocs = bench_allocs - allocs;
+            bench_quiet(0);
+            if (!ok) {
+                printf("Error: Export failed\n");
+                song_free(&song);
+                return 0;
+            }
+
+            char name[32];
+            const char* modes[] = {"1 thread", "all CPUs", "cell edit", "unchanged", "sinc", "loop x4", "segment",
+                                   "effects", "stems"};
+            snprintf(name, sizeof(name), "%3d patterns, %s", lengths[l], modes[pass]);
+            bench_report(name, t, frames);
+            printf("%-22s %9lld heap allocations\n", "", allocs);
+        }
+        song_free(&song);
+    }
+    render_cache_free(&render_cache);
+    arena_free(&render_arena);
+    remove(wav_path);
+    for (int s = 0; s <= BENCH_CHANNELS; s++) {
+        char path[512];
+        render_stem_path(path, sizeof(path), wav_path, s, BENCH_CHANNELS);
+        remove(path);
+    }
+    return 1;
+}
+
+// ---- Time one song file operation, repeated until it has run long enough ----
+// 'op' is 0 to save text, 1 to save binary, 2 to save packed, 3 to load.
+double bench_file_op(Song* song, const char* path, int op, int* runs) {
+    double start = bench_now();
+    double t = 0;
+    *runs = 0;
+
+    do {
+        bench_quiet(1);
+        int ok;
+        if (op == 3) {
+            // Loading replaces a song, so start from an empty one
+            Song loaded;
+            ok = song_init(&loaded, 1, 1);
+            if (ok) {
+                ok = load_song(&loaded, path);
+                song_free(&loaded);
+            }
+        } else {
+            ok = save_song(song, path, op == 2);
+        }
+        bench_quiet(0);
+        if (!ok) return -1;
+
+        (*runs)++;
+        t = bench_now() - start;
+    } while (t < BENCH_MIN_TIME);
+
+    return t / *runs;
+}
+
+// ---- Song file save and load throughput, text and binary ----
+int bench_files(const char* sample_path, const char* dir) {
+    Song song;
+    if (!bench_song(&song, 64, sample_path)) {
+        printf("Error: Could not build the benchmark song\n");
+        return 0;
+    }
+
+    double cells = (double)song_length(&song) * song.num_channels;
+    printf("\nSong files: %d patterns, %.0f cells\n", song.num_patterns, cells);
+
+    const char* formats[] = {"text", "binary", "packed"};
+    const char* exts[] = {".ctrack", ".ctb", ".ctb"};
+    int ok = 1;
+
+    for (int f = 0; ok && f < 3; f++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/bench_%s%s", dir, formats[f], exts[f]);
+
+        for (int op = 0; op < 2; op++) {
+            int runs;
+            double t = bench_file_op(&song, path, op == 0 ? f : 3, &runs);
+            if (t < 0) {
+                printf("Error: Could not %s %s\n", op == 0 ? "save" : "load", path);
+                ok = 0;
+                break;
+            }
+
+            struct stat st;
+            double mb = stat(path, &st) == 0 ? st.st_size / 1e6 : 0;
+            printf("%-6s %-4s %9.3f ms  %8.2f Mcells/s  %8.1f MB/s  (%d runs)\n", formats[f],
+                   op == 0 ? "save" : "load", t * 1e3, cells / t / 1e6, mb / t, runs);
+        }
+        remove(path);
+    }
+
+    song_free(&song);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 600.0;
+    const char* only = argc > 2 ? argv[2] : NULL;
+    if (seconds <= 0) seconds = 1;
+
+    mix_kernels_init();
+    pitch_table_init();
+    oscillator_init();
+    resampler_init();
+
+    // Scratch files go to the temp directory
+    const char* dir = getenv("TMPDIR");
+    if (!dir || !dir[0]) dir = "/tmp";
+    char sample_path[512], wav_path[512];
+    snprintf(sample_path, sizeof(sample_path), "%s/ctracker_bench_%d.wav", dir, (int)getpid());
+    snprintf(wav_path, sizeof(wav_path), "%s/ctracker_bench_%d_out.wav", dir, (int)getpid());
+
+    printf("Mix kernel: %s\n", mix_kernels.name);
+
+    int ok = 1;
+    if (!only || strcmp(only, "mix") == 0) ok = bench_mix(seconds) && ok;
+    if (!only || strcmp(only, "voices") == 0) ok = bench_voices(seconds) && ok;
+
+    if (!only || strcmp(only, "export") == 0 || strcmp(only, "files") == 0) {
+        if (!bench_write_sample(sample_path)) {
+            printf("Error: Could not write %s\n", sample_path);
+            return 1;
+        }
+        if (!only || strcmp(only, "export") == 0) ok = bench_export(sample_path, wav_path) && ok;
+        if (!only || strcmp(only, "files") == 0) ok = bench_files(sample_path, dir) && ok;
+        remove(sample_path);
+    }
+
+    return ok ? 0 : 1;
+}
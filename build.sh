@@ -1 +1,2 @@
-gcc CTracker.c -o CTracker $(sdl2-config --cflags --libs) -lSDL2_mixer -lm
+gcc CTracker.c -o CTracker $(sdl2-config --cflags --libs) -lm -lpthread
+gcc -O2 CTracker_bench.c -o CTracker_bench $(sdl2-config --cflags --libs) -lm -lpthread